@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# cache-test.sh - Checks that the cache keeps a mix of object sizes that
+#     fits its budget: twelve files from 100 bytes to 90 KB, about half
+#     the default cache between them, are fetched through the proxy
+#     three rounds over, and Tiny must have served each of them once.
+#
+#     usage: ./cache-test.sh [proxy options]
+#
+
+SIZES="100 500 2000 8000 20000 35000 50000 60000 70000 80000 85000 90000"
+ROUNDS=3
+TIMEOUT=5
+TEST_DIR=".cache-test"
+HOME_DIR=`pwd`
+
+killall -q proxy tiny 2> /dev/null
+
+if [ ! -x ./tiny/tiny ]
+then
+    (cd ./tiny; make)
+fi
+if [ ! -x ./proxy ]
+then
+    echo "Error: ./proxy not found or not an executable file."
+    exit 1
+fi
+
+# The objects, in Tiny's directory so it can serve them
+rm -rf ./tiny/${TEST_DIR} ./${TEST_DIR}
+mkdir ./tiny/${TEST_DIR} ./${TEST_DIR}
+for size in ${SIZES}
+do
+    head -c ${size} /dev/urandom > ./tiny/${TEST_DIR}/${size}.bin
+done
+
+tiny_port=`./free-port.sh`
+cd ./tiny
+stdbuf -oL ./tiny ${tiny_port} > ${HOME_DIR}/${TEST_DIR}/tiny.log 2>&1 &
+tiny_pid=$!
+cd ${HOME_DIR}
+sleep 1
+proxy_port=`./free-port.sh`
+./proxy -p 0 "$@" ${proxy_port} > /dev/null 2>&1 &
+proxy_pid=$!
+sleep 1
+
+failed=0
+for round in `seq 1 ${ROUNDS}`
+do
+    for size in ${SIZES}
+    do
+        curl --max-time ${TIMEOUT} --silent \
+            --proxy http://localhost:${proxy_port} \
+            --output ./${TEST_DIR}/${size}.bin \
+            http://localhost:${tiny_port}/${TEST_DIR}/${size}.bin
+        if ! cmp -s ./${TEST_DIR}/${size}.bin ./tiny/${TEST_DIR}/${size}.bin
+        then
+            echo "Round ${round}: ${size}.bin came back wrong"
+            failed=1
+        fi
+    done
+done
+
+kill ${proxy_pid} ${tiny_pid} 2> /dev/null
+wait 2> /dev/null
+
+# Tiny logs the headers of each request it serves. Every file was
+# fetched in the first round, so any request past one per file is a refetch
+nfiles=`echo ${SIZES} | wc -w`
+fetches=`grep -c "^Host:" ./${TEST_DIR}/tiny.log`
+if [ "${fetches}" != "${nfiles}" ]
+then
+    echo "Tiny served ${fetches} requests for ${nfiles} files"
+    failed=1
+fi
+
+rm -rf ./tiny/${TEST_DIR} ./${TEST_DIR}
+if [ ${failed} == 0 ]
+then
+    echo "cache-test: passed"
+else
+    echo "cache-test: FAILED"
+fi
+exit ${failed}
@@ -0,0 +1,2038 @@
+/*
+ * cache.c - web object cache shared by all connections
+ *
+ * Objects live in one memfd segment, sized by the cache's byte budget,
+ * that is also mapped into the proxy. Each is kept as the origin's status
+ * line and end-to-end headers, already serialized with a Content-Length,
+ * followed by the body. A hit is then a single writev() of the headers,
+ * the client's Connection line and the body straight from the mapping;
+ * whatever a full socket leaves is sendfile()d from the segment, never
+ * copied through user space.
+ *
+ * The segment is divided into slabs of slab_size bytes: SLAB_PAGE, or
+ * less for a small cache, so that every size class can have at least
+ * SLAB_MIN_PAGES slabs of its own. A slab holding small objects is carved
+ * into equal chunks of one size class, every class a quarter larger than
+ * the one before, up to half a slab. A block takes a chunk of the
+ * smallest class it fits, so however object sizes churn the chunks never
+ * fragment: a freed chunk is exactly what the next object of its class
+ * needs, and both taking and freeing one are O(1). A larger object takes
+ * a run of whole slabs instead, contiguous so that it can be sent with
+ * a single sendfile(), and wastes less than one slab doing so.
+ *
+ * When a small object has no free chunk of its class, objects are
+ * evicted by CLOCK: a hit only sets the block's referenced bit, and the
+ * clock hand passes over (and clears) referenced blocks to stop at the
+ * first one that has not been hit since its last visit. If that block is
+ * small and of another class, its whole slab is evicted and passes to the
+ * class in need, which rebalances slabs between classes as the mix of
+ * sizes shifts. A large one gives its run back to the free slabs. A
+ * victim still in use would only give its room back once released, so
+ * the hand passes over it too; one victim normally makes the room, and
+ * at most SLAB_VICTIMS are looked at. A large object with no free run
+ * needs adjacent slabs, which the clock's order would not free short of
+ * emptying the cache, so it takes the window of slabs that holds the
+ * fewest objects, and only if every one of them can be evicted at once.
+ *
+ * A response that varies is stored as a variant of its URL, with the key
+ * http_variant gives the request it answered under its Vary names; a
+ * lookup finds the variant whose key the asking request shares. The
+ * variants of a URL share its hash, so they sit in one chain under one
+ * shard lock, and storing one under a new Vary drops those stored under
+ * the old. Clients only tail a fill of their own variant.
+ *
+ * A block found stale is not dropped: the caller revalidates it with the
+ * server, and on a 304 it is stored again with the headers the 304 sent
+ * in place of the old ones (RFC 9111 4.3.4), or else the new object is
+ * stored in its place. Either response may forbid storing it any more,
+ * and then the block is dropped, from memory and disk.
+ *
+ * Admission is TinyLFU: every request, hit or miss, is counted once in a
+ * count-min sketch of recent request frequencies, 4-bit counters packed
+ * two to a byte, which is halved every SKETCH_SAMPLE requests per counter
+ * so old popularity fades. Once the cache is full, a new object only
+ * displaces the objects eviction would take if it has been asked for
+ * more often than each of them: the victim the clock picks, or, when
+ * that means moving the victim's slab to another class, every object on
+ * the slab, or every object in a large one's window. That keeps one-hit wonders from flushing the hot set. New
+ * objects go in just behind the hand, so an admitted one gets a full
+ * revolution to prove itself. Unlike W-TinyLFU there is no LRU window
+ * that takes every new object unconditionally: the clock replaces both
+ * it and the segmented LRU behind it, so a new object has to win
+ * admission from its first store, while a burst of requests for it is
+ * still answered once by the coalesced fill.
+ *
+ * Objects are filed under the canonical key http_cache_key gives the
+ * request's URI, and under the hash it computed then; nothing here hashes
+ * a URL again.
+ *
+ * The index is a hash table split into CACHE_SHARDS shards, each behind
+ * its own reader-writer lock, so concurrent hits only share a read lock
+ * on one shard. SearchNode returns a referenced block from that single
+ * lookup. An evicted block leaves the index at once, but its chunk is
+ * only reused after the last reader has released it.
+ *
+ * A miss is fetched once however many clients ask for the object at the
+ * same time: the first to claim the URL fetches it, and the rest wait for
+ * that fill. Once the fetcher knows the body's length it captures the
+ * body into the fill's buffer, and the others tail it from there as it
+ * grows instead of waiting for the end. Fills in progress are kept per
+ * shard under a mutex of their own, since waiting needs a condition
+ * variable.
+ *
+ * With a disk tier (see disk.c), whatever is stored is written through
+ * to disk as well, and a miss in memory looks there before going to the
+ * server. Since the disk is reclaimed first-in, first-out, a block that
+ * outlives its disk copy is spilled again as it is evicted. An object
+ * read back from disk is put in the segment if admitted, and otherwise
+ * served once from a private copy. Only threads of the cache's own wait
+ * on the disk. A single writer takes the write-throughs, the spills and
+ * the objects to forget, in order; a spill is copied out of the segment
+ * first, so eviction frees its chunk at once, and writes are skipped
+ * while the writer lags CACHE_DISK_BACKLOG bytes behind. Reader threads
+ * serve SearchNodeAsync, which hands them the misses the disk may hold
+ * and is called back as dns_lookup_async is, so an event loop never
+ * blocks on a read; SearchNode reads on the calling thread.
+ *
+ * cache_lock guards the slabs and the clock ring, and is
+ * taken before any shard lock. Hits never take it.
+ */
+#define _GNU_SOURCE
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "csapp.h"
+#include "cache.h"
+#include "disk.h"
+
+#define CACHE_ALIGN		64		/* the smallest chunk, and their granularity */
+#define CACHE_SHARDS	64		/* independently locked parts of the index */
+#define CACHE_BUCKETS	256		/* hash chains per shard */
+
+#define SLAB_CLASSES	64		/* most chunk sizes */
+#define SLAB_PAGE		65536	/* largest slab */
+#define SLAB_MIN_PAGE	4096	/* ... and the smallest */
+#define SLAB_MIN_PAGES	4		/* slabs the cache can give each class */
+#define SLAB_FREE		(-1)	/* slab classes besides the chunk sizes: */
+#define SLAB_RUN		(-2)	/* ... part of a large object's run */
+#define SLAB_WINDOWS	4		/* runs' worth of slabs weighed for a large
+								 * object, the emptiest first */
+#define SLAB_VICTIMS	8		/* most evictions to free a chunk */
+
+#define SKETCH_DEPTH	4		/* rows, each indexed by its own hash */
+#define SKETCH_MIN		1024	/* least counters per row */
+#define SKETCH_BYTES	512		/* of cache budget per counter in a row */
+#define SKETCH_MAX		15		/* 4-bit counters saturate here */
+#define SKETCH_SAMPLE	10		/* lookups per counter between halvings */
+
+#define CACHE_DISK_READERS	4		/* threads reading objects back from disk */
+#define CACHE_DISK_BACKLOG	(16 << 20)	/* bytes the disk writer may lag by */
+
+/* A slab_size part of the segment, carved into chunks of one class or
+ * part of a run */
+typedef struct slab {
+	int cls;					/* size class, SLAB_FREE or SLAB_RUN */
+	int npages;					/* slabs in the run it starts, if it does */
+	int nfree;					/* chunks not in use */
+	int *free_chunks;			/* ... a stack of their indices */
+	cache_block **owner;		/* the block indexed in each chunk (the run's
+								 * in the first), or NULL */
+	struct slab *prev, *next;	/* on its class's partial list, or free */
+} slab;
+
+/* Someone waiting for a fill without blocking */
+typedef struct cache_waiter {
+	void (*done)(void *);
+	void *arg;
+	struct cache_waiter *next;
+} cache_waiter;
+
+/* Work for the disk threads: a block to write, or else a hash to forget
+ * or to read back */
+typedef struct disk_job {
+	cache_block *block;			/* written, then its reference dropped */
+	int bytes;					/* ... counted in the writer's backlog */
+	unsigned long hash;
+	char *url;					/* to read, NULL to forget; */
+	http_request *r;			/* ... the rest as SearchNodeAsync had them */
+	int again;
+	cache_block **hit;
+	void (*done)(void *);
+	void *arg;
+	struct disk_job *next;
+} disk_job;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* signalled as jobs are queued */
+	disk_job *head, *tail;
+} disk_queue;
+
+/* Padded to a cache line so shards' locks don't share one */
+typedef struct {
+	pthread_rwlock_t lock;
+	cache_block *buckets[CACHE_BUCKETS];
+	pthread_mutex_t fill_lock;
+	pthread_cond_t fill_cond;	/* signalled as fills end */
+	cache_fill *fills;
+} __attribute__((aligned(64))) cache_shard;
+
+static cache_shard shards[CACHE_SHARDS];
+static int cache_fd;			/* the memfd segment */
+static char *cache_base;		/* ... and where it is mapped */
+static slab *slabs;
+static int nslabs, slab_size;
+static int class_size[SLAB_CLASSES], nclasses;
+static slab *partial[SLAB_CLASSES];	/* slabs with free chunks, by class */
+static slab *free_slabs;
+static cache_block *hand;		/* clock hand, NULL if the ring is empty */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Frequency sketch: SKETCH_DEPTH rows of sketch_mask + 1 4-bit counters,
+ * two to a byte */
+static unsigned char *sketch;
+static unsigned long sketch_mask;
+static unsigned long sketch_adds, sketch_sample;
+static int admit_all;			/* no admission filter, for comparison */
+
+/* The disk writer's queue, and the disk readers' */
+static disk_queue writes = { PTHREAD_MUTEX_INITIALIZER,
+							PTHREAD_COND_INITIALIZER };
+static disk_queue reads = { PTHREAD_MUTEX_INITIALIZER,
+							PTHREAD_COND_INITIALIZER };
+static pthread_once_t disk_once = PTHREAD_ONCE_INIT;
+static long backlog;			/* bytes of blocks queued for the writer */
+
+/* Counters, see cache_print_stats */
+static unsigned long nhits, nmisses, nstored, nrejected, nevicted, ncoalesced;
+static unsigned long nmoved, nskipped;
+
+int max_object_size = MAX_OBJECT_SIZE;
+
+static void slab_init(long cache_size);
+static cache_block *promote(char *url, unsigned long hash, http_request *r);
+static void demote(cache_block *block);
+static void job_put(disk_queue *q, disk_job *job);
+
+
+/*
+ * initCache - set up a cache holding cache_size bytes of objects, none
+ *             larger than object_size. With no_admission every object
+ *             that fits is stored, as plain CLOCK
+ */
+void initCache(long cache_size, int object_size, int no_admission)
+{
+	unsigned long width = SKETCH_MIN;
+	int i;
+
+	if (object_size > cache_size)
+		object_size = cache_size;
+	max_object_size = object_size;
+	cache_size = cache_size / CACHE_ALIGN * CACHE_ALIGN;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		pthread_rwlock_init(&shards[i].lock, NULL);
+		pthread_mutex_init(&shards[i].fill_lock, NULL);
+		pthread_cond_init(&shards[i].fill_cond, NULL);
+	}
+	if ((cache_fd = memfd_create("proxy-cache", MFD_CLOEXEC)) < 0)
+		unix_error("memfd_create error");
+	if (ftruncate(cache_fd, cache_size) < 0)
+		unix_error("ftruncate error");
+	cache_base = Mmap(NULL, cache_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+					cache_fd, 0);
+	slab_init(cache_size);
+
+	admit_all = no_admission;
+	while (width < cache_size / SKETCH_BYTES)
+		width *= 2;
+	sketch = Calloc(SKETCH_DEPTH, width / 2);
+	sketch_mask = width - 1;
+	sketch_sample = SKETCH_SAMPLE * width;
+}
+
+/*
+ * sketch_slot - the index of the counter for hash in row i. FNV-1a's
+ *               high bits are mixed down first, the shards having used
+ *               the low ones
+ */
+static unsigned long sketch_slot(unsigned long hash, int i)
+{
+	unsigned long h = hash * 0x9e3779b97f4a7c15UL;
+
+	h ^= h >> 29;
+	return i * (sketch_mask + 1) + ((h + i * ((h >> 32) | 1)) & sketch_mask);
+}
+
+static int sketch_get(unsigned long slot)
+{
+	return __atomic_load_n(&sketch[slot / 2], __ATOMIC_RELAXED) >>
+		(slot % 2 * 4) & 0xf;
+}
+
+/*
+ * sketch_add - count a lookup of hash, halving every counter once per
+ *              sample. Updates are racy by design: a lost halving or
+ *              increment only makes an estimate a little off
+ */
+static void sketch_add(unsigned long hash)
+{
+	unsigned char *p, old;
+	unsigned long i, slot;
+	int shift;
+
+	for (i = 0; i < SKETCH_DEPTH; i++) {
+		slot = sketch_slot(hash, i);
+		p = &sketch[slot / 2];
+		shift = slot % 2 * 4;
+		old = __atomic_load_n(p, __ATOMIC_RELAXED);
+		while ((old >> shift & 0xf) < SKETCH_MAX &&
+			!__atomic_compare_exchange_n(p, &old, old + (1 << shift), 1,
+									__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+	if (__atomic_add_fetch(&sketch_adds, 1, __ATOMIC_RELAXED) !=
+		sketch_sample)
+		return;
+	for (i = 0; i < SKETCH_DEPTH * (sketch_mask + 1) / 2; i++)
+		__atomic_store_n(&sketch[i],
+			__atomic_load_n(&sketch[i], __ATOMIC_RELAXED) >> 1 & 0x77,
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&sketch_adds, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * sketch_estimate - how often hash has been looked up lately
+ */
+static int sketch_estimate(unsigned long hash)
+{
+	int i, n, min = SKETCH_MAX;
+
+	for (i = 0; i < SKETCH_DEPTH; i++)
+		if ((n = sketch_get(sketch_slot(hash, i))) < min)
+			min = n;
+	return min;
+}
+
+static cache_shard *shard_of(unsigned long hash)
+{
+	return &shards[hash % CACHE_SHARDS];
+}
+
+static cache_block **bucket_of(unsigned long hash)
+{
+	return &shard_of(hash)->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+static int aligned(int size)
+{
+	return (size + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+static void list_push(slab **list, slab *s)
+{
+	s->prev = NULL;
+	if ((s->next = *list) != NULL)
+		s->next->prev = s;
+	*list = s;
+}
+
+static void list_del(slab **list, slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		*list = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+}
+
+/*
+ * size_classes - set up the chunk sizes for slabs of slab_size bytes,
+ *                the largest half a slab
+ */
+static void size_classes(void)
+{
+	int size;
+
+	nclasses = 0;
+	for (size = CACHE_ALIGN; size <= slab_size / 2 && nclasses < SLAB_CLASSES;
+		size = aligned(size + size / 4 + 1))
+		class_size[nclasses++] = size;
+}
+
+/*
+ * slab_init - divide cache_size bytes into slabs, halving them from
+ *             SLAB_PAGE until each size class could have SLAB_MIN_PAGES
+ */
+static void slab_init(long cache_size)
+{
+	int i;
+
+	for (slab_size = SLAB_PAGE; ; slab_size /= 2) {
+		size_classes();
+		if (slab_size <= SLAB_MIN_PAGE ||
+			cache_size / slab_size >= (long)SLAB_MIN_PAGES * nclasses)
+			break;
+	}
+	if (slab_size > cache_size) {
+		slab_size = cache_size;
+		size_classes();
+	}
+	nslabs = cache_size / slab_size;
+	slabs = Calloc(nslabs, sizeof(slab));
+	for (i = nslabs - 1; i >= 0; i--) {
+		slabs[i].cls = SLAB_FREE;
+		list_push(&free_slabs, &slabs[i]);
+	}
+}
+
+/*
+ * slab_class - the smallest class whose chunks hold size bytes
+ * Returns SLAB_RUN if size needs a run of slabs instead
+ */
+static int slab_class(int size)
+{
+	int cls;
+
+	for (cls = 0; cls < nclasses; cls++)
+		if (class_size[cls] >= size)
+			return cls;
+	return SLAB_RUN;
+}
+
+/* Slabs in the run for an object of size bytes */
+static int run_pages(int size)
+{
+	return (size + slab_size - 1) / slab_size;
+}
+
+static slab *slab_of(off_t offset)
+{
+	return &slabs[offset / slab_size];
+}
+
+static int chunk_of(slab *s, off_t offset)
+{
+	if (s->cls == SLAB_RUN)
+		return 0;
+	return offset % slab_size / class_size[s->cls];
+}
+
+/*
+ * slab_alloc - take a chunk of class cls, carving a free slab if the
+ *              class has none; cache_lock must be held
+ * Returns its offset, or -1 if there is neither
+ */
+static off_t slab_alloc(int cls)
+{
+	slab *s = partial[cls];
+	int i, n;
+
+	if (s == NULL) {
+		if ((s = free_slabs) == NULL)
+			return -1;
+		list_del(&free_slabs, s);
+		n = slab_size / class_size[cls];
+		s->cls = cls;
+		s->nfree = n;
+		s->free_chunks = Malloc(n * sizeof(int));
+		s->owner = Calloc(n, sizeof(cache_block *));
+		for (i = 0; i < n; i++)
+			s->free_chunks[i] = n - 1 - i;
+		list_push(&partial[cls], s);
+	}
+	i = s->free_chunks[--s->nfree];
+	if (s->nfree == 0)
+		list_del(&partial[cls], s);
+	return (off_t)(s - slabs) * slab_size + (off_t)i * class_size[cls];
+}
+
+/*
+ * run_take - take the npages slabs from start as a run, if all are free;
+ *            cache_lock must be held
+ * Returns its offset, or -1
+ */
+static off_t run_take(int start, int npages)
+{
+	int i;
+
+	for (i = start; i < start + npages; i++)
+		if (slabs[i].cls != SLAB_FREE)
+			return -1;
+	for (i = start; i < start + npages; i++) {
+		list_del(&free_slabs, &slabs[i]);
+		slabs[i].cls = SLAB_RUN;
+		slabs[i].npages = 0;
+	}
+	slabs[start].npages = npages;
+	slabs[start].owner = Calloc(1, sizeof(cache_block *));
+	return (off_t)start * slab_size;
+}
+
+/*
+ * run_alloc - take the first run of npages free slabs; cache_lock must be
+ *             held
+ * Returns its offset, or -1 if there is none
+ */
+static off_t run_alloc(int npages)
+{
+	int i, start = 0;
+
+	for (i = 0; i < nslabs && i - start < npages; i++)
+		if (slabs[i].cls != SLAB_FREE)
+			start = i + 1;
+	if (i - start < npages)
+		return -1;
+	return run_take(start, npages);
+}
+
+/*
+ * slab_take - take room for an object of size bytes and class cls, see
+ *             slab_class; cache_lock must be held
+ * Returns its offset, or -1 if there is none free
+ */
+static off_t slab_take(int cls, int size)
+{
+	return cls == SLAB_RUN ? run_alloc(run_pages(size)) : slab_alloc(cls);
+}
+
+/*
+ * slab_free - return a chunk, and its slab to the free slabs once it is
+ *             wholly unused, or a run's slabs; cache_lock must be held
+ */
+static void slab_free(off_t offset)
+{
+	slab *s = slab_of(offset);
+	int i, n;
+
+	if (s->cls == SLAB_RUN) {
+		for (i = s->npages - 1; i >= 0; i--) {
+			s[i].cls = SLAB_FREE;
+			list_push(&free_slabs, &s[i]);
+		}
+		Free(s->owner);
+		s->owner = NULL;
+		return;
+	}
+	i = chunk_of(s, offset);
+	n = slab_size / class_size[s->cls];
+	s->owner[i] = NULL;
+	s->free_chunks[s->nfree++] = i;
+	if (s->nfree == 1 && n > 1)
+		list_push(&partial[s->cls], s);
+	if (s->nfree < n)
+		return;
+	if (n > 1)
+		list_del(&partial[s->cls], s);
+	Free(s->free_chunks);
+	Free(s->owner);
+	s->owner = NULL;
+	s->cls = SLAB_FREE;
+	list_push(&free_slabs, s);
+}
+
+/*
+ * ring_add - put a block on the clock ring just behind the hand, so it is
+ *            the last the hand reaches
+ */
+static void ring_add(cache_block *block)
+{
+	if (hand == NULL) {
+		block->prev = block->next = hand = block;
+		return;
+	}
+	block->next = hand;
+	block->prev = hand->prev;
+	hand->prev->next = block;
+	hand->prev = block;
+}
+
+static void ring_del(cache_block *block)
+{
+	if (block->next == block) {
+		hand = NULL;
+		return;
+	}
+	block->prev->next = block->next;
+	block->next->prev = block->prev;
+	if (hand == block)
+		hand = block->next;
+}
+
+static void free_block(cache_block *block)
+{
+	free(block->copy);
+	free(block->vary);
+	free(block->variant);
+	free(block->etag);
+	free(block->modified);
+	Free(block->url);
+	Free(block);
+}
+
+/*
+ * destroy - free a block nobody refers to any more
+ */
+static void destroy(cache_block *block)
+{
+	if (block->copy == NULL) {
+		pthread_mutex_lock(&cache_lock);
+		slab_free(block->offset);
+		pthread_mutex_unlock(&cache_lock);
+	}
+	free_block(block);
+}
+
+/*
+ * victim - sweep the clock hand to a block not hit since its last visit;
+ *          cache_lock must be held and the ring not empty
+ */
+static cache_block *victim(void)
+{
+	while (__atomic_exchange_n(&hand->referenced, 0, __ATOMIC_RELAXED))
+		hand = hand->next;
+	return hand;
+}
+
+/*
+ * unindex - take a block out of its hash chain; the shard lock must be
+ *           held for writing
+ */
+static void unindex(cache_block *block)
+{
+	cache_block **pp;
+
+	for (pp = bucket_of(block->hash); *pp != block; pp = &(*pp)->hnext)
+		;
+	*pp = block->hnext;
+	block->cached = 0;
+}
+
+/*
+ * drop - take an unindexed block off the clock ring; cache_lock must be
+ *        held. The chunk is freed with the block's last reference
+ */
+static void drop(cache_block *block)
+{
+	ring_del(block);
+	if (__atomic_sub_fetch(&block->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		slab_free(block->offset);
+		free_block(block);
+	}
+}
+
+/*
+ * evict - drop a block from the cache, spilling it to disk unless a copy
+ *         is still there; cache_lock must be held
+ */
+static void evict(cache_block *block)
+{
+	cache_shard *shard = shard_of(block->hash);
+
+	nevicted++;
+	if (!disk_holds(__atomic_load_n(&block->disk, __ATOMIC_RELAXED)))
+		demote(block);
+	pthread_rwlock_wrlock(&shard->lock);
+	unindex(block);
+	pthread_rwlock_unlock(&shard->lock);
+	drop(block);
+}
+
+/*
+ * evict_slab - evict every block in a slab, so that it passes to another
+ *              class once the last of them is released; cache_lock must
+ *              be held
+ */
+static void evict_slab(slab *s)
+{
+	int i, n = slab_size / class_size[s->cls];
+
+	nmoved++;
+	for (i = 0; i < n && s->owner; i++)		// NULL once the slab is free
+		if (s->owner[i] && s->owner[i]->cached)
+			evict(s->owner[i]);
+}
+
+/*
+ * same - whether two strings that may be NULL are equal
+ */
+static int same(char *a, char *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
+
+/*
+ * serves - whether an object that varies on vary, fetched for a request
+ *          whose key under it was variant (NULL if too long to keep),
+ *          also answers r
+ */
+static int serves(char *vary, char *variant, http_request *r)
+{
+	char key[HTTP_MAX_VARIANT];
+
+	return vary == NULL || (variant &&
+		http_variant(r, vary, key, sizeof(key)) >= 0 && !strcmp(key, variant));
+}
+
+/*
+ * find - look up the variant of url that answers r in its bucket; the
+ *        shard lock must be held
+ */
+static cache_block *find(char *url, unsigned long hash, http_request *r)
+{
+	cache_block *block;
+
+	for (block = *bucket_of(hash); block; block = block->hnext)
+		if (block->hash == hash && !strcmp(block->url, url) &&
+			serves(block->vary, block->variant, r))
+			return block;
+	return NULL;
+}
+
+/*
+ * lookup - find the variant of url that answers r in memory, taking a
+ *          reference to it and marking it referenced for the clock
+ */
+static cache_block *lookup(char *url, unsigned long hash, http_request *r)
+{
+	cache_shard *shard = shard_of(hash);
+	cache_block *block;
+
+	pthread_rwlock_rdlock(&shard->lock);
+	if ((block = find(url, hash, r)) != NULL) {
+		__atomic_add_fetch(&block->refcnt, 1, __ATOMIC_RELAXED);
+		if (!block->referenced)		// spare the cache line if already set
+			__atomic_store_n(&block->referenced, 1, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	return block;
+}
+
+/*
+ * SearchNode - look up the variant of url that answers r, in memory and
+ *              then on disk, taking a reference the caller drops with
+ *              ReleaseNode. The request is counted, in the sketch and the
+ *              hit ratio, unless this is a look again after waiting for
+ *              another client's fill
+ * Returns NULL on a miss
+ */
+cache_block *SearchNode(char *url, http_request *r, int again)
+{
+	unsigned long hash = r->hash;
+	cache_block *block;
+
+	if (!again)
+		sketch_add(hash);
+	if ((block = lookup(url, hash, r)) == NULL)
+		block = promote(url, hash, r);
+	if (!again)
+		__atomic_fetch_add(block ? &nhits : &nmisses, 1, __ATOMIC_RELAXED);
+	return block;
+}
+
+/*
+ * SearchNodeAsync - SearchNode without blocking on the disk: a miss in
+ *                   memory that the disk may hold is read back on a disk
+ *                   reader thread, which sets *hit and then calls
+ *                   done(arg). r must last until then
+ * Returns CACHE_DONE with *hit set, or CACHE_PENDING
+ */
+int SearchNodeAsync(char *url, http_request *r, int again, cache_block **hit,
+					void (*done)(void *), void *arg)
+{
+	unsigned long hash = r->hash;
+	disk_job *job;
+
+	if (!again)
+		sketch_add(hash);
+	if ((*hit = lookup(url, hash, r)) == NULL && disk_probe(hash)) {
+		job = Calloc(1, sizeof(disk_job));
+		job->hash = hash;
+		job->url = strdup(url);
+		job->r = r;
+		job->again = again;
+		job->hit = hit;
+		job->done = done;
+		job->arg = arg;
+		job_put(&reads, job);
+		return CACHE_PENDING;
+	}
+	if (!again)
+		__atomic_fetch_add(*hit ? &nhits : &nmisses, 1, __ATOMIC_RELAXED);
+	return CACHE_DONE;
+}
+
+void ReleaseNode(cache_block *block)
+{
+	if (__atomic_sub_fetch(&block->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		destroy(block);
+}
+
+/*
+ * FreshNode - whether a block may be served without revalidating it
+ */
+int FreshNode(cache_block *block)
+{
+	return __atomic_load_n(&block->expires, __ATOMIC_RELAXED) > time(NULL);
+}
+
+/*
+ * RefreshNode - the server says a stale block is still good until expires
+ */
+void RefreshNode(cache_block *block, time_t expires)
+{
+	__atomic_store_n(&block->expires, expires, __ATOMIC_RELAXED);
+}
+
+/* Ends the stored headers, depending on the client connection */
+static const char *connection_line[] = {
+	"Connection: close\r\n\r\n",
+	"Connection: keep-alive\r\n\r\n"
+};
+
+/*
+ * write_response - writev a response made of headers, the Connection line
+ *                  for keep_alive and body from *pos on, advancing *pos,
+ *                  until it reaches limit
+ * Returns 1 once it has, 0 if a non-blocking fd would block and -1 on error
+ */
+static int write_response(int fd, char *headers, int hdrlen, int keep_alive,
+						char *body, int len, int *pos, int limit)
+{
+	const char *conn = connection_line[keep_alive != 0];
+	int connlen = strlen(conn);
+	struct iovec iov[3];
+	int i, skip;
+	ssize_t n;
+
+	while (*pos < limit) {
+		iov[0].iov_base = headers;
+		iov[0].iov_len = hdrlen;
+		iov[1].iov_base = (char *)conn;
+		iov[1].iov_len = connlen;
+		iov[2].iov_base = body;
+		iov[2].iov_len = len;
+		for (i = 0, skip = *pos; skip >= (int)iov[i].iov_len; i++)
+			skip -= iov[i].iov_len;
+		iov[i].iov_base = (char *)iov[i].iov_base + skip;
+		iov[i].iov_len -= skip;
+		if ((n = writev(fd, iov + i, 3 - i)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		*pos += n;
+	}
+	return 1;
+}
+
+/*
+ * SendData - send the object, headers first, from *pos on to fd,
+ *            advancing *pos. The headers go out in one writev with as
+ *            much of the body as the socket takes, and the rest of the
+ *            body is sendfile()d
+ * Returns 1 when it has all been sent, 0 if a non-blocking fd would block
+ * and -1 on error
+ */
+int SendData(int fd, cache_block *block, int keep_alive, int *pos)
+{
+	int head = block->hdrlen + strlen(connection_line[keep_alive != 0]);
+	off_t offset;
+	ssize_t n;
+	int r;
+
+	if (block->copy)			// not in the segment: no sendfile()
+		return write_response(fd, block->headers, block->hdrlen, keep_alive,
+							block->data, block->size, pos, head + block->size);
+	if (*pos < head && (r = write_response(fd, block->headers, block->hdrlen,
+				keep_alive, block->data, block->size, pos, head)) <= 0)
+		return r;
+	while (*pos < head + block->size) {
+		offset = block->offset + block->hdrlen + *pos - head;
+		if ((n = sendfile(fd, cache_fd, &offset,
+						head + block->size - *pos)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 0;
+			return -1;
+		}
+		*pos += n;
+	}
+	return 1;
+}
+
+/*
+ * add_part - append a piece to a ranged response
+ */
+static void add_part(cache_range *rg, char *p, int offset, int len)
+{
+	rg->parts[rg->nparts].p = p;
+	rg->parts[rg->nparts].offset = offset;
+	rg->parts[rg->nparts++].len = len;
+}
+
+/*
+ * cache_range_init - make the answer to r's Range, if it has one, from a
+ *                    block: a 206 with the one range asked for, or with
+ *                    several as multipart/byteranges, or a 416 if none can
+ *                    be satisfied. The 206 has the stored headers but for
+ *                    the framing, and the Content-Type moves into the
+ *                    parts if there are several
+ * Returns the number of pieces to send with SendRange, or 0 if r is to
+ * get the whole object from SendData
+ */
+int cache_range_init(cache_range *rg, cache_block *block, http_request *r,
+					int keep_alive)
+{
+	static unsigned int nboundaries;
+	const char *conn = connection_line[keep_alive != 0];
+	http_range ranges[HTTP_MAX_RANGES];
+	char *h = block->headers, *end = h + block->hdrlen, *line, *next;
+	char *type = NULL, *t, boundary[32];
+	int i, n, typelen = 0, total = 0;
+
+	rg->text = NULL;
+	rg->nparts = 0;
+	if ((n = http_ranges(r, block->etag, block->modified, block->size,
+						ranges)) == 0)
+		return 0;
+	if (n < 0) {
+		rg->text = Malloc(128 + strlen(conn));
+		add_part(rg, rg->text, 0, sprintf(rg->text, "HTTP/1.1 416 Range Not "
+					"Satisfiable\r\nContent-Range: bytes */%d\r\n"
+					"Content-Length: 0\r\n%s", block->size, conn));
+		return rg->nparts;
+	}
+	for (line = h; (next = memchr(line, '\n', end - line)) != NULL;
+		line = next + 1)
+		if (!strncasecmp(line, "Content-Type:", 13)) {
+			type = line;
+			typelen = next + 1 - line;
+		}
+	snprintf(boundary, sizeof(boundary), "%016lx%08x", block->hash,
+			__atomic_add_fetch(&nboundaries, 1, __ATOMIC_RELAXED));
+
+	// The parts' headers go first in text, so that the head can be
+	// written once the length of the whole body is known
+	rg->text = t = Malloc(block->hdrlen + strlen(conn) + 256 +
+						n * (typelen + 128));
+	add_part(rg, NULL, 0, 0);		// the head, filled in below
+	for (i = 0; n > 1 && i < n; i++) {
+		next = t;
+		t += sprintf(t, "%s--%s\r\n", i ? "\r\n" : "", boundary);
+		memcpy(t, type, typelen);
+		t += typelen;
+		t += sprintf(t, "Content-Range: bytes %ld-%ld/%d\r\n\r\n",
+					ranges[i].first, ranges[i].last, block->size);
+		add_part(rg, next, 0, t - next);
+		add_part(rg, NULL, ranges[i].first,
+				ranges[i].last - ranges[i].first + 1);
+		total += t - next + ranges[i].last - ranges[i].first + 1;
+	}
+	if (n > 1) {
+		next = t;
+		t += sprintf(t, "\r\n--%s--\r\n", boundary);
+		add_part(rg, next, 0, t - next);
+		total += t - next;
+	}
+	else {
+		add_part(rg, NULL, ranges[0].first,
+				ranges[0].last - ranges[0].first + 1);
+		total = ranges[0].last - ranges[0].first + 1;
+	}
+
+	// The head: the stored headers without the status line, the framing
+	// that ends them or, if there are parts, the Content-Type
+	rg->parts[0].p = t;
+	t += sprintf(t, "HTTP/1.1 206 Partial Content\r\n");
+	for (line = (char *)memchr(h, '\n', end - h) + 1;
+		(next = memchr(line, '\n', end - line)) != NULL && next + 1 < end;
+		line = next + 1)
+		if (line != type || n == 1) {
+			memcpy(t, line, next + 1 - line);
+			t += next + 1 - line;
+		}
+	if (n > 1)
+		t += sprintf(t, "Content-Type: multipart/byteranges; boundary=%s\r\n",
+					boundary);
+	else
+		t += sprintf(t, "Content-Range: bytes %ld-%ld/%d\r\n",
+					ranges[0].first, ranges[0].last, block->size);
+	t += sprintf(t, "Content-Length: %d\r\n%s", total, conn);
+	rg->parts[0].len = t - rg->parts[0].p;
+	return rg->nparts;
+}
+
+/*
+ * SendRange - send a ranged response from *pos on to fd, advancing
+ *             *pos; its body parts are sendfile()d from the segment
+ * Returns as SendData does
+ */
+int SendRange(int fd, cache_block *block, cache_range *rg, int *pos)
+{
+	int i, skip = *pos;
+	off_t offset;
+	ssize_t n;
+
+	for (i = 0; i < rg->nparts; i++, skip = 0) {
+		if (skip >= rg->parts[i].len) {
+			skip -= rg->parts[i].len;
+			continue;
+		}
+		while (skip < rg->parts[i].len) {
+			offset = rg->parts[i].offset + skip;
+			if (rg->parts[i].p)
+				n = write(fd, rg->parts[i].p + skip, rg->parts[i].len - skip);
+			else if (block->copy)
+				n = write(fd, block->data + offset, rg->parts[i].len - skip);
+			else {
+				offset += block->offset + block->hdrlen;
+				n = sendfile(fd, cache_fd, &offset, rg->parts[i].len - skip);
+			}
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return 0;
+				return -1;
+			}
+			skip += n;
+			*pos += n;
+		}
+	}
+	return 1;
+}
+
+/*
+ * cache_range_free - free what cache_range_init made, if anything
+ */
+void cache_range_free(cache_range *rg)
+{
+	free(rg->text);
+	rg->text = NULL;
+	rg->nparts = 0;
+}
+
+/*
+ * length_line - the Content-Length header framing length body bytes
+ */
+static int length_line(char *buf, int length)
+{
+	return sprintf(buf, "Content-Length: %d\r\n", length);
+}
+
+/*
+ * new_block - a block for url, its headers and body still to be placed
+ */
+static cache_block *new_block(char *url, unsigned long hash, int hdrlen,
+							int length, cache_meta *meta)
+{
+	cache_block *block = Malloc(sizeof(cache_block));
+
+	block->url = strdup(url);
+	block->hash = hash;
+	block->hdrlen = hdrlen;
+	block->size = length;
+	block->copy = NULL;
+	block->disk = 0;
+	block->refcnt = 1;
+	block->cached = 0;
+	block->referenced = 0;
+	block->expires = meta->expires;
+	block->etag = meta->etag && *meta->etag ? strdup(meta->etag) : NULL;
+	block->modified = meta->modified && *meta->modified ?
+					strdup(meta->modified) : NULL;
+	block->vary = meta->vary && *meta->vary ? strdup(meta->vary) : NULL;
+	block->variant = block->vary ? strdup(meta->variant) : NULL;
+	return block;
+}
+
+/*
+ * private_block - a block for url kept outside the segment, holding
+ *                 meta's headers and framing, then the length bytes of
+ *                 data
+ */
+static cache_block *private_block(char *url, unsigned long hash,
+								cache_meta *meta, char *framing, char *data,
+								int length)
+{
+	int framelen = strlen(framing);
+	cache_block *block = new_block(url, hash, meta->hdrlen + framelen, length,
+									meta);
+
+	block->offset = -1;
+	block->copy = Malloc(block->hdrlen + length);
+	block->headers = block->copy;
+	block->data = block->copy + block->hdrlen;
+	memcpy(block->headers, meta->headers, meta->hdrlen);
+	memcpy(block->headers + meta->hdrlen, framing, framelen);
+	memcpy(block->data, data, length);
+	return block;
+}
+
+/*
+ * block_meta - what is stored with a block besides its body
+ */
+static void block_meta(cache_block *block, cache_meta *meta)
+{
+	meta->headers = block->headers;
+	meta->hdrlen = block->hdrlen;
+	meta->expires = block->expires;
+	meta->etag = block->etag;
+	meta->modified = block->modified;
+	meta->vary = block->vary;
+	meta->variant = block->variant;
+}
+
+static disk_job *job_get(disk_queue *q)
+{
+	disk_job *job;
+
+	pthread_mutex_lock(&q->lock);
+	while ((job = q->head) == NULL)
+		pthread_cond_wait(&q->cond, &q->lock);
+	if ((q->head = job->next) == NULL)
+		q->tail = NULL;
+	pthread_mutex_unlock(&q->lock);
+	return job;
+}
+
+/*
+ * disk_writer - thread writing blocks to disk, and forgetting those the
+ *               server no longer lets the cache keep. It is disk.c's only
+ *               writer
+ */
+static void *disk_writer(void *vargp)
+{
+	disk_job *job;
+	cache_block *block;
+	cache_meta meta;
+	unsigned int seg;
+
+	Pthread_detach(Pthread_self());
+	while (1) {
+		job = job_get(&writes);
+		if ((block = job->block) == NULL)
+			disk_forget(job->hash);
+		else {
+			block_meta(block, &meta);
+			seg = disk_store(block->url, block->hash, &meta, "", block->data,
+							block->size);
+			if (block->copy == NULL)		// a stored block, not a spill
+				__atomic_store_n(&block->disk, seg, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&backlog, job->bytes, __ATOMIC_RELAXED);
+			ReleaseNode(block);
+		}
+		Free(job);
+	}
+	return NULL;
+}
+
+/*
+ * disk_reader - thread reading back objects that SearchNodeAsync missed
+ *               in memory
+ */
+static void *disk_reader(void *vargp)
+{
+	disk_job *job;
+	cache_block *block;
+
+	Pthread_detach(Pthread_self());
+	while (1) {
+		job = job_get(&reads);
+		block = promote(job->url, job->hash, job->r);
+		if (!job->again)
+			__atomic_fetch_add(block ? &nhits : &nmisses, 1,
+								__ATOMIC_RELAXED);
+		*job->hit = block;
+		job->done(job->arg);
+		free(job->url);
+		Free(job);
+	}
+	return NULL;
+}
+
+static void start_disk_threads(void)
+{
+	pthread_t tid;
+	int i;
+
+	Pthread_create(&tid, NULL, disk_writer, NULL);
+	for (i = 0; i < CACHE_DISK_READERS; i++)
+		Pthread_create(&tid, NULL, disk_reader, NULL);
+}
+
+/*
+ * job_put - queue a job for the disk threads, starting them the first
+ *           time. Reads are served by several, writes by one, in order
+ */
+static void job_put(disk_queue *q, disk_job *job)
+{
+	pthread_once(&disk_once, start_disk_threads);
+	pthread_mutex_lock(&q->lock);
+	job->next = NULL;
+	if (q->tail)
+		q->tail->next = job;
+	else
+		q->head = job;
+	q->tail = job;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * reserve - count bytes more in the writer's backlog, unless it is
+ *           CACHE_DISK_BACKLOG behind already and they should be skipped
+ */
+static int reserve(int bytes)
+{
+	if (__atomic_add_fetch(&backlog, bytes, __ATOMIC_RELAXED)
+		<= CACHE_DISK_BACKLOG)
+		return 1;
+	__atomic_sub_fetch(&backlog, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&nskipped, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * spill - hand a block to the writer with a reference it drops once the
+ *         block is on disk; the bytes must have been reserved
+ */
+static void spill(cache_block *block, int bytes)
+{
+	disk_job *job = Calloc(1, sizeof(disk_job));
+
+	job->block = block;
+	job->bytes = bytes;
+	job_put(&writes, job);
+}
+
+/*
+ * demote - spill a copy of a block being evicted, so that its chunk is
+ *          free at once and nobody waits on the write; cache_lock must be
+ *          held
+ */
+static void demote(cache_block *block)
+{
+	cache_meta meta;
+	int bytes = block->hdrlen + block->size;
+
+	if (!reserve(bytes))
+		return;
+	block_meta(block, &meta);
+	spill(private_block(block->url, block->hash, &meta, "", block->data,
+						block->size), bytes);
+}
+
+/*
+ * forget - have the writer drop hash's object from disk, after whatever
+ *          it was asked to write before
+ */
+static void forget(unsigned long hash)
+{
+	disk_job *job;
+
+	if (!disk_enabled())
+		return;
+	job = Calloc(1, sizeof(disk_job));
+	job->hash = hash;
+	job_put(&writes, job);
+}
+
+/*
+ * evicts_alone - whether making room for an object of class cls takes
+ *                evicting only the clock's victim, rather than its slab:
+ *                if it is large, or of that class
+ */
+static int evicts_alone(cache_block *block, int cls)
+{
+	slab *s = slab_of(block->offset);
+
+	return s->cls == SLAB_RUN || s->cls == cls;
+}
+
+/*
+ * idle - whether evicting a block gives its room back at once: it is
+ *        still cached, and nobody else holds it
+ */
+static int idle(cache_block *block)
+{
+	return block != NULL && block->cached &&
+		__atomic_load_n(&block->refcnt, __ATOMIC_ACQUIRE) == 1;
+}
+
+/*
+ * outranks - whether an object looked up freq times lately may displace
+ *            block under admission
+ */
+static int outranks(int freq, cache_block *block)
+{
+	return admit_all || sketch_estimate(block->hash) < freq;
+}
+
+/*
+ * slab_idle - whether evicting the blocks on a slab of chunks frees it at
+ *             once: every chunk in use is held by an idle block, none
+ *             being reserved for a store or kept by an evicted one
+ */
+static int slab_idle(slab *s)
+{
+	int i, used = 0, n = slab_size / class_size[s->cls];
+
+	for (i = 0; i < n; i++)
+		if (s->owner[i] != NULL) {
+			if (!idle(s->owner[i]))
+				return 0;
+			used++;
+		}
+	return used == n - s->nfree;
+}
+
+/*
+ * slab_outranked - whether an object looked up freq times lately may
+ *                  displace every block on a slab of chunks
+ */
+static int slab_outranked(int freq, slab *s)
+{
+	int i, n = slab_size / class_size[s->cls];
+
+	for (i = 0; i < n; i++)
+		if (s->owner[i] && s->owner[i]->cached &&
+			!outranks(freq, s->owner[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * admits - whether an object of class cls looked up freq times lately
+ *          has been asked for more often than each block evicting the
+ *          clock's victim would drop: the victim alone, or all those on
+ *          its slab, see evicts_alone; cache_lock must be held
+ */
+static int admits(int freq, cache_block *block, int cls)
+{
+	if (evicts_alone(block, cls))
+		return outranks(freq, block);
+	return slab_outranked(freq, slab_of(block->offset));
+}
+
+/*
+ * make_chunk - evict to free a chunk of class cls for an object looked up
+ *              freq times: the clock's victim, or its whole slab, see
+ *              admits. Victims whose room would only come back once
+ *              their readers let go are passed over, and at most
+ *              SLAB_VICTIMS are looked at; cache_lock must be held
+ * Returns the chunk's offset, or -1
+ */
+static off_t make_chunk(int cls, int freq)
+{
+	cache_block *block;
+	off_t offset = -1;
+	int i;
+
+	for (i = 0; i < SLAB_VICTIMS && offset < 0 && hand; i++) {
+		block = victim();
+		if (evicts_alone(block, cls) ? !idle(block) :
+			!slab_idle(slab_of(block->offset))) {
+			hand = hand->next;			// in use: try the next one
+			continue;
+		}
+		if (!admits(freq, block, cls))
+			break;
+		if (evicts_alone(block, cls))
+			evict(block);
+		else
+			evict_slab(slab_of(block->offset));
+		offset = slab_alloc(cls);
+	}
+	return offset;
+}
+
+/*
+ * slab_weight - the objects evicting a slab would lose: its chunks in
+ *               use, or one for a slab of a run
+ */
+static int slab_weight(slab *s)
+{
+	if (s->cls == SLAB_FREE)
+		return 0;
+	if (s->cls == SLAB_RUN)
+		return 1;
+	return slab_size / class_size[s->cls] - s->nfree;
+}
+
+/*
+ * run_start - the first slab of the run slab s is part of
+ */
+static slab *run_start(slab *s)
+{
+	while (s->npages == 0)
+		s--;
+	return s;
+}
+
+/*
+ * run_frees - whether evicting the blocks on the npages slabs from start
+ *             frees them all at once, each being idle and looked up less
+ *             often than freq; cache_lock must be held. A run reaching
+ *             into them is evicted whole
+ */
+static int run_frees(int start, int npages, int freq)
+{
+	slab *s;
+	int i;
+
+	for (i = start; i < start + npages; i++) {
+		s = &slabs[i];
+		if (s->cls == SLAB_RUN) {
+			s = run_start(s);
+			if (!idle(s->owner[0]) || !outranks(freq, s->owner[0]))
+				return 0;
+			i = s - slabs + s->npages - 1;
+		}
+		else if (s->cls != SLAB_FREE &&
+				(!slab_idle(s) || !slab_outranked(freq, s)))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * evict_run - evict the blocks on the npages slabs from start, once
+ *             run_frees allows it; cache_lock must be held
+ */
+static void evict_run(int start, int npages)
+{
+	slab *s;
+	int i, end;
+
+	for (i = start; i < start + npages; i++) {
+		s = &slabs[i];
+		if (s->cls == SLAB_RUN) {
+			s = run_start(s);
+			end = s - slabs + s->npages - 1;
+			evict(s->owner[0]);
+			i = end;
+		}
+		else if (s->cls != SLAB_FREE)
+			evict_slab(s);
+	}
+}
+
+/*
+ * make_run - evict to free npages adjacent slabs for an object looked up
+ *            freq times. The clock's order would free them anywhere, so
+ *            of the SLAB_WINDOWS runs' worth of slabs holding the fewest
+ *            objects, the first run_frees allows is emptied; cache_lock
+ *            must be held
+ * Returns the run's offset, or -1 if none will do
+ */
+static off_t make_run(int npages, int freq)
+{
+	int start[SLAB_WINDOWS], weight[SLAB_WINDOWS];
+	int i, j, w = 0, n = 0;
+
+	for (i = 0; i < nslabs; i++) {
+		w += slab_weight(&slabs[i]);
+		if (i >= npages)
+			w -= slab_weight(&slabs[i - npages]);
+		if (i < npages - 1)
+			continue;
+		if (n < SLAB_WINDOWS)
+			n++;
+		else if (w >= weight[n - 1])
+			continue;
+		for (j = n - 1; j > 0 && weight[j - 1] > w; j--) {
+			start[j] = start[j - 1];
+			weight[j] = weight[j - 1];
+		}
+		start[j] = i - npages + 1;
+		weight[j] = w;
+	}
+	for (j = 0; j < n; j++)
+		if (run_frees(start[j], npages, freq)) {
+			evict_run(start[j], npages);
+			return run_take(start[j], npages);
+		}
+	return -1;
+}
+
+/*
+ * insert - copy an object into the segment, its headers made of meta's
+ *          and framing, replacing a stale copy of its variant, and any
+ *          stored under another Vary. Others are evicted to make room if
+ *          it is looked up more often than each of them, see make_chunk
+ *          and make_run. The copy is made outside the locks, with the
+ *          space reserved meanwhile
+ * Returns the block with a reference for the caller (a fresh copy stored
+ * concurrently, if there is one), or NULL if it was not admitted
+ */
+static cache_block *insert(char *url, unsigned long hash, cache_meta *meta,
+						char *framing, char *data, int length)
+{
+	cache_shard *shard = shard_of(hash);
+	cache_block *block, *old, **pp, *replaced = NULL;
+	char *vary = meta->vary && *meta->vary ? meta->vary : NULL;
+	slab *s;
+	off_t offset;
+	int freq = sketch_estimate(hash);
+	int framelen = strlen(framing), hdrlen = meta->hdrlen + framelen;
+	int cls = slab_class(hdrlen + length);
+
+	if (length > max_object_size ||
+		(cls == SLAB_RUN && run_pages(hdrlen + length) > nslabs))
+		return NULL;
+	pthread_mutex_lock(&cache_lock);
+	if ((offset = slab_take(cls, hdrlen + length)) < 0 && hand) {
+		offset = cls == SLAB_RUN ? make_run(run_pages(hdrlen + length), freq)
+				: make_chunk(cls, freq);
+		if (offset < 0)
+			nrejected++;
+	}
+	if (offset >= 0)
+		nstored++;
+	pthread_mutex_unlock(&cache_lock);
+	if (offset < 0)				// rejected, or room is held by evicted
+		return NULL;			// blocks still in use
+
+	block = new_block(url, hash, hdrlen, length, meta);
+	block->offset = offset;
+	block->headers = cache_base + offset;
+	block->data = block->headers + hdrlen;
+	block->cached = 1;
+	block->refcnt = 2;
+	memcpy(block->headers, meta->headers, meta->hdrlen);
+	memcpy(block->headers + meta->hdrlen, framing, framelen);
+	memcpy(block->data, data, length);
+
+	pthread_mutex_lock(&cache_lock);
+	pthread_rwlock_wrlock(&shard->lock);
+	for (old = *bucket_of(hash); old; old = old->hnext)
+		if (old->hash == hash && !strcmp(old->url, url) &&
+			same(old->vary, vary) && same(old->variant, block->variant) &&
+			FreshNode(old)) {
+			// lost a race with another store
+			__atomic_add_fetch(&old->refcnt, 1, __ATOMIC_RELAXED);
+			pthread_rwlock_unlock(&shard->lock);
+			slab_free(offset);
+			nstored--;
+			pthread_mutex_unlock(&cache_lock);
+			free_block(block);
+			return old;
+		}
+	for (pp = bucket_of(hash); (old = *pp) != NULL; )
+		if (old->hash == hash && !strcmp(old->url, url) &&
+			(!same(old->vary, vary) || same(old->variant, block->variant))) {
+			*pp = old->hnext;
+			old->cached = 0;
+			old->hnext = replaced;		// unlinked: reuse the link
+			replaced = old;
+		}
+		else
+			pp = &old->hnext;
+	pp = bucket_of(hash);
+	block->hnext = *pp;
+	*pp = block;
+	pthread_rwlock_unlock(&shard->lock);
+	for (; (old = replaced) != NULL; drop(old))
+		replaced = old->hnext;
+	s = slab_of(offset);
+	s->owner[chunk_of(s, offset)] = block;
+	ring_add(block);
+	pthread_mutex_unlock(&cache_lock);
+	return block;
+}
+
+/*
+ * store - insert an object and have the disk writer write it through:
+ *         the stored block, or a private copy if it was not admitted
+ * Returns the block with a reference for the caller, as insert does
+ */
+static cache_block *store(char *url, unsigned long hash, cache_meta *meta,
+						char *framing, char *data, int length)
+{
+	cache_block *block;
+	int bytes = meta->hdrlen + strlen(framing) + length;
+
+	block = insert(url, hash, meta, framing, data, length);
+	if (!disk_enabled() || !reserve(bytes))
+		return block;
+	if (block != NULL) {
+		__atomic_add_fetch(&block->refcnt, 1, __ATOMIC_RELAXED);
+		spill(block, bytes);
+	}
+	else
+		spill(private_block(url, hash, meta, framing, data, length), bytes);
+	return block;
+}
+
+/*
+ * StoreData - copy an object fetched for r into the cache with its
+ *             headers, the time it goes stale and its validators,
+ *             replacing a stale copy, and write it through to disk. If it
+ *             varies, it is kept as the variant for requests like r,
+ *             beside those for others
+ */
+void StoreData(char *url, http_request *r, char *data, int length,
+				cache_meta *meta)
+{
+	unsigned long hash = r->hash;
+	cache_shard *shard = shard_of(hash);
+	cache_block *block;
+	cache_meta m = *meta;
+	char framing[64], variant[HTTP_MAX_VARIANT];
+	int fresh;
+
+	if (length > max_object_size)
+		return;
+	m.variant = "";
+	if (m.vary && *m.vary) {
+		if (http_variant(r, m.vary, variant, sizeof(variant)) < 0)
+			return;
+		m.variant = variant;
+	}
+	pthread_rwlock_rdlock(&shard->lock);
+	fresh = (block = find(url, hash, r)) != NULL && FreshNode(block);
+	pthread_rwlock_unlock(&shard->lock);
+	if (fresh)					// stored by a concurrent miss
+		return;
+
+	length_line(framing, length);
+	if ((block = store(url, hash, &m, framing, data, length)) != NULL)
+		ReleaseNode(block);
+}
+
+/*
+ * line_len - the length of the header line at p, of the len bytes there
+ */
+static int line_len(char *p, int len)
+{
+	char *nl = memchr(p, '\n', len);
+
+	return nl ? nl - p + 1 : len;
+}
+
+/*
+ * has_field - whether the len bytes of header lines at hdrs include one
+ *             for the field whose name is the namelen bytes at name
+ */
+static int has_field(char *hdrs, int len, char *name, int namelen)
+{
+	int n;
+
+	for (; len > 0; hdrs += n, len -= n) {
+		n = line_len(hdrs, len);
+		if (n > namelen && hdrs[namelen] == ':' &&
+			!strncasecmp(hdrs, name, namelen))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * merge_headers - write to buf a block's stored headers updated with the
+ *                 hdrlen bytes of a 304's at hdrs: the stored status
+ *                 line, every stored field the 304 does not send, then
+ *                 all it does. The stored framing is left out
+ * Returns their length, at most block->hdrlen + hdrlen
+ */
+static int merge_headers(char *buf, cache_block *block, char *hdrs,
+						int hdrlen)
+{
+	char *p = block->headers, *colon;
+	int len = block->hdrlen, n, total;
+
+	n = line_len(hdrs, hdrlen);		// the 304's own status line
+	hdrs += n;
+	hdrlen -= n;
+	total = n = line_len(p, len);
+	memcpy(buf, p, n);
+	for (p += n, len -= n; len > 0; p += n, len -= n) {
+		n = line_len(p, len);
+		if ((colon = memchr(p, ':', n)) == NULL ||
+			!strncasecmp(p, "Content-Length:", 15) ||
+			has_field(hdrs, hdrlen, p, colon - p))
+			continue;
+		memcpy(buf + total, p, n);
+		total += n;
+	}
+	memcpy(buf + total, hdrs, hdrlen);
+	return total + hdrlen;
+}
+
+/*
+ * UpdateNode - the server answered the revalidation of a stale block with
+ *              a 304, whose headers as store_header keeps them, freshness
+ *              and validators are in meta: merge those headers into the
+ *              block's own. If keep is set it is stored again with them,
+ *              or, should that fail, at least has its expiry refreshed;
+ *              otherwise it is dropped, and answers just this request
+ *              from a private copy. The caller's reference to block
+ *              passes to the result
+ * Returns the block to answer the request with
+ */
+cache_block *UpdateNode(cache_block *block, cache_meta *meta, int keep)
+{
+	cache_block *updated = NULL;
+	cache_meta m;
+	char framing[64];
+
+	if (meta->hdrlen > 0) {
+		m.headers = Malloc(block->hdrlen + meta->hdrlen);
+		m.hdrlen = merge_headers(m.headers, block, meta->headers,
+								meta->hdrlen);
+		m.expires = meta->expires;
+		m.etag = meta->etag && *meta->etag ? meta->etag : block->etag;
+		m.modified = meta->modified && *meta->modified ? meta->modified :
+					block->modified;
+		m.vary = block->vary;
+		m.variant = block->variant ? block->variant : "";
+		length_line(framing, block->size);
+		if (keep)
+			updated = store(block->url, block->hash, &m, framing,
+							block->data, block->size);
+		else
+			updated = private_block(block->url, block->hash, &m, framing,
+									block->data, block->size);
+		Free(m.headers);
+	}
+	if (!keep)
+		DropNode(block);
+	if (updated == NULL) {
+		RefreshNode(block, meta->expires);
+		return block;
+	}
+	ReleaseNode(block);
+	return updated;
+}
+
+/*
+ * DropNode - take a block out of the cache, and its copy off the disk,
+ *            once the server says it may not be stored. The caller keeps
+ *            its reference
+ */
+void DropNode(cache_block *block)
+{
+	cache_shard *shard = shard_of(block->hash);
+	int cached;
+
+	pthread_mutex_lock(&cache_lock);
+	pthread_rwlock_wrlock(&shard->lock);
+	if ((cached = block->cached) != 0)
+		unindex(block);
+	pthread_rwlock_unlock(&shard->lock);
+	if (cached)
+		drop(block);
+	pthread_mutex_unlock(&cache_lock);
+	forget(block->hash);
+}
+
+/*
+ * promote - look url up on disk after a miss in memory. The disk keeps
+ *           only the variant stored last
+ * Returns a referenced block, or NULL if it is not there either
+ */
+static cache_block *promote(char *url, unsigned long hash, http_request *r)
+{
+	disk_object obj;
+	cache_block *block;
+
+	if (!disk_lookup(url, hash, &obj))
+		return NULL;
+	if (!serves(*obj.meta.vary ? obj.meta.vary : NULL, obj.meta.variant, r)) {
+		Free(obj.record);
+		return NULL;
+	}
+	if ((block = insert(url, hash, &obj.meta, "", obj.data, obj.size))
+		!= NULL) {
+		if (block->disk == 0)
+			block->disk = obj.seg;
+		Free(obj.record);
+		return block;
+	}
+	block = new_block(url, hash, obj.meta.hdrlen, obj.size, &obj.meta);
+	block->offset = -1;
+	block->copy = obj.record;
+	block->headers = obj.meta.headers;
+	block->data = obj.data;
+	return block;
+}
+
+static cache_fill *find_fill(cache_shard *shard, char *url,
+							unsigned long hash)
+{
+	cache_fill *f;
+
+	for (f = shard->fills; f; f = f->next)
+		if (f->hash == hash && !strcmp(f->url, url))
+			return f;
+	return NULL;
+}
+
+/*
+ * put_fill - drop a reference to a fill; its fill_lock must be held
+ */
+static void put_fill(cache_fill *f)
+{
+	if (--f->refcnt == 0) {
+		free(f->vary);
+		free(f->variant);
+		Free(f->headers);
+		Free(f->data);
+		Free(f->url);
+		Free(f);
+	}
+}
+
+/*
+ * wake_fill - wake everyone waiting on a fill, its fill_lock held. The
+ *             callbacks are returned to be made once it is released
+ */
+static cache_waiter *wake_fill(cache_fill *f)
+{
+	cache_waiter *w = f->waiters;
+
+	f->waiters = NULL;
+	pthread_cond_broadcast(&shard_of(f->hash)->fill_cond);
+	return w;
+}
+
+static void call_waiters(cache_waiter *w)
+{
+	cache_waiter *next;
+
+	for (; w; w = next) {
+		next = w->next;
+		w->done(w->arg);
+		Free(w);
+	}
+}
+
+static void add_waiter(cache_fill *f, void (*done)(void *), void *arg)
+{
+	cache_waiter *w = Malloc(sizeof(cache_waiter));
+
+	w->done = done;
+	w->arg = arg;
+	w->next = f->waiters;
+	f->waiters = w;
+}
+
+/*
+ * tails - whether a fill can be tailed to answer r: its body is coming,
+ *         and it is the variant r wants; the fill_lock must be held
+ */
+static int tails(cache_fill *f, http_request *r)
+{
+	return f->size >= 0 && !f->failed && serves(f->vary, f->variant, r);
+}
+
+/*
+ * cache_claim - after a miss on url for r, claim the fetch of it unless
+ *               another client already has. done, if not NULL, is how to
+ *               wait for that client without blocking: it is called with
+ *               arg, on the fetching thread, once the body can be tailed
+ *               or the fetch is over, and the caller then tries
+ *               cache_attach
+ * Returns CACHE_FETCH if the caller is to fetch the object into *fill,
+ * CACHE_STREAM if it is to tail *fill, CACHE_PENDING if done will be
+ * called, and otherwise CACHE_RETRY once the other fetch is over, or
+ * turns out to be of another variant. After a retry the caller looks url
+ * up again and on a second miss fetches it without claiming
+ */
+int cache_claim(char *url, http_request *r, cache_fill **fill,
+				void (*done)(void *), void *arg)
+{
+	unsigned long hash = r->hash;
+	cache_shard *shard = shard_of(hash);
+	cache_fill *f;
+	int rc = CACHE_RETRY;
+
+	pthread_mutex_lock(&shard->fill_lock);
+	if ((f = find_fill(shard, url, hash)) == NULL) {
+		f = Calloc(1, sizeof(cache_fill));
+		f->url = strdup(url);
+		f->hash = hash;
+		f->size = -1;
+		f->refcnt = 1;
+		f->next = shard->fills;
+		shard->fills = f;
+		*fill = f;
+		pthread_mutex_unlock(&shard->fill_lock);
+		return CACHE_FETCH;
+	}
+	__atomic_fetch_add(&ncoalesced, 1, __ATOMIC_RELAXED);
+	if (f->size < 0 && done) {
+		add_waiter(f, done, arg);
+		pthread_mutex_unlock(&shard->fill_lock);
+		return CACHE_PENDING;
+	}
+	f->refcnt++;
+	while (f->size < 0 && !f->done)
+		pthread_cond_wait(&shard->fill_cond, &shard->fill_lock);
+	if (tails(f, r)) {
+		*fill = f;					// keep the reference
+		rc = CACHE_STREAM;
+	}
+	else
+		put_fill(f);
+	pthread_mutex_unlock(&shard->fill_lock);
+	return rc;
+}
+
+/*
+ * cache_attach - once woken from a pending claim, take a reference to the
+ *                fill for url if it can be tailed to answer r
+ * Returns 1 if it can, 0 if the caller is to look url up again instead
+ */
+int cache_attach(char *url, http_request *r, cache_fill **fill)
+{
+	unsigned long hash = r->hash;
+	cache_shard *shard = shard_of(hash);
+	cache_fill *f;
+	int attached = 0;
+
+	pthread_mutex_lock(&shard->fill_lock);
+	if ((f = find_fill(shard, url, hash)) != NULL && tails(f, r)) {
+		f->refcnt++;
+		*fill = f;
+		attached = 1;
+	}
+	pthread_mutex_unlock(&shard->fill_lock);
+	return attached;
+}
+
+/*
+ * cache_fill_start - the object claimed for r has a response with the
+ *                    given headers and Vary (as for StoreData) and a body
+ *                    of size bytes: let other clients tail it
+ * Returns the buffer to capture the body into, and to pass to StoreData
+ */
+char *cache_fill_start(cache_fill *f, http_request *r, char *vary,
+						char *headers, int hdrlen, int size)
+{
+	cache_shard *shard = shard_of(f->hash);
+	cache_waiter *w;
+	char *p = Malloc(hdrlen + 64), key[HTTP_MAX_VARIANT];
+
+	memcpy(p, headers, hdrlen);
+	hdrlen += length_line(p + hdrlen, size);
+
+	pthread_mutex_lock(&shard->fill_lock);
+	f->headers = p;
+	f->hdrlen = hdrlen;
+	if (vary && *vary) {
+		f->vary = strdup(vary);
+		f->variant = http_variant(r, vary, key, sizeof(key)) < 0 ? NULL :
+					strdup(key);
+	}
+	f->data = Malloc(size > 0 ? size : 1);
+	f->size = size;
+	w = wake_fill(f);
+	pthread_mutex_unlock(&shard->fill_lock);
+	call_waiters(w);
+	return f->data;
+}
+
+/*
+ * cache_fill_grow - the first len bytes of the body have been captured
+ */
+void cache_fill_grow(cache_fill *f, int len)
+{
+	cache_shard *shard = shard_of(f->hash);
+	cache_waiter *w;
+
+	pthread_mutex_lock(&shard->fill_lock);
+	__atomic_store_n(&f->len, len, __ATOMIC_RELEASE);
+	w = wake_fill(f);
+	pthread_mutex_unlock(&shard->fill_lock);
+	call_waiters(w);
+}
+
+/*
+ * cache_fill_end - the fetch claimed for the fill is over: wake the
+ *                  clients waiting on it. Those tailing it are cut off
+ *                  unless the body is complete
+ */
+void cache_fill_end(cache_fill *f, int complete)
+{
+	cache_shard *shard = shard_of(f->hash);
+	cache_fill **pp;
+	cache_waiter *w;
+
+	pthread_mutex_lock(&shard->fill_lock);
+	for (pp = &shard->fills; *pp != f; pp = &(*pp)->next)
+		;
+	*pp = f->next;
+	f->done = 1;
+	f->failed = !complete || f->len < f->size;
+	w = wake_fill(f);
+	put_fill(f);
+	pthread_mutex_unlock(&shard->fill_lock);
+	call_waiters(w);
+}
+
+void ReleaseFill(cache_fill *f)
+{
+	cache_shard *shard = shard_of(f->hash);
+
+	pthread_mutex_lock(&shard->fill_lock);
+	put_fill(f);
+	pthread_mutex_unlock(&shard->fill_lock);
+}
+
+/*
+ * TailData - write the fill's response from *pos on to fd as its body
+ *            arrives, advancing *pos. Without done, waits for the rest;
+ *            with it, arranges for done(arg) to be called when more has
+ *            come
+ * Returns 1 when it has all been sent, 0 if a non-blocking fd would
+ * block, CACHE_PENDING when waiting on done, and -1 on error or if the
+ * fetch failed
+ */
+int TailData(int fd, cache_fill *f, int keep_alive, int *pos,
+			void (*done)(void *), void *arg)
+{
+	cache_shard *shard = shard_of(f->hash);
+	int head = f->hdrlen + strlen(connection_line[keep_alive != 0]);
+	int len, r;
+
+	for (;;) {
+		len = __atomic_load_n(&f->len, __ATOMIC_ACQUIRE);
+		if ((r = write_response(fd, f->headers, f->hdrlen, keep_alive,
+						f->data, len, pos, head + len)) <= 0)
+			return r;
+		if (len == f->size)
+			return 1;
+
+		pthread_mutex_lock(&shard->fill_lock);
+		while (f->len == len && !f->failed && !done)
+			pthread_cond_wait(&shard->fill_cond, &shard->fill_lock);
+		if (f->failed) {
+			pthread_mutex_unlock(&shard->fill_lock);
+			return -1;
+		}
+		if (f->len == len) {
+			add_waiter(f, done, arg);
+			pthread_mutex_unlock(&shard->fill_lock);
+			return CACHE_PENDING;
+		}
+		pthread_mutex_unlock(&shard->fill_lock);
+	}
+}
+
+void cache_print_stats(FILE *fp)
+{
+	unsigned long lookups = nhits + nmisses;
+
+	fprintf(fp, "cache: %lu hits, %lu misses (%.1f%% hit ratio), "
+			"%lu coalesced, %lu stored, %lu rejected, %lu evicted, "
+			"%lu slabs moved", nhits, nmisses,
+			lookups ? 100.0 * nhits / lookups : 0.0, ncoalesced, nstored,
+			nrejected, nevicted, nmoved);
+	if (disk_enabled())
+		fprintf(fp, ", %lu disk writes skipped", nskipped);
+	fprintf(fp, "\n");
+}
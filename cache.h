@@ -0,0 +1,120 @@
+/*
+ * cache.h - web object cache shared by all connections
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include "http.h"
+
+/* Default budgets, see initCache */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+extern int max_object_size;		/* largest object the cache takes */
+
+/* Return values of cache_claim */
+#define CACHE_FETCH		0	/* fetch the object, then cache_fill_end */
+#define CACHE_RETRY		1	/* the concurrent fetch is over, look again */
+#define CACHE_PENDING	2	/* the callback will say when to look again */
+#define CACHE_STREAM	3	/* tail the concurrent fetch with TailData */
+
+/* Return values of SearchNodeAsync, besides CACHE_PENDING */
+#define CACHE_DONE		4	/* the lookup is over, its result set */
+
+/* What is stored with an object besides its body */
+typedef struct {
+	char *headers;				/* the status line and end-to-end headers */
+	int hdrlen;					/* ... without a blank line or framing */
+	time_t expires;				/* when it goes stale */
+	char *etag;					/* validators, "" or NULL if none */
+	char *modified;
+	char *vary;					/* Vary header names, "" or NULL if none */
+	char *variant;				/* see http_variant; set by StoreData */
+} cache_meta;
+
+typedef struct cache_block {
+	char *url;
+	unsigned long hash;			/* of url */
+	char *headers;				/* response headers, then the body, in */
+	int hdrlen;					/* ... the shared segment; no blank line */
+	char *data;					/* object bytes */
+	int size;
+	off_t offset;				/* of headers within the segment */
+	char *copy;					/* ... or the block's own, if not in it */
+	unsigned int disk;			/* segment of its copy on disk, see disk.c */
+	time_t expires;				/* when it goes stale, see RefreshNode */
+	char *etag;					/* validators to revalidate it with, */
+	char *modified;				/* ... NULL if the server sent none */
+	char *vary;					/* Vary header names, NULL if none, */
+	char *variant;				/* ... and the request's key under them */
+	int refcnt;					/* holders, the cache itself included */
+	int cached;					/* still in the index and clock ring */
+	int referenced;				/* hit since the clock hand last passed */
+	struct cache_block *hnext;			/* hash chain */
+	struct cache_block *prev, *next;	/* clock ring */
+} cache_block;
+
+/* Pieces of a response made from a cached object, see cache_range_init */
+#define CACHE_MAX_PARTS (2 * HTTP_MAX_RANGES + 2)
+
+/* A 206 or 416 answer to a Range request, made from a cached object */
+typedef struct {
+	char *text;					/* holds its head and the parts' headers */
+	int nparts;					/* 0 if the whole object is sent instead */
+	struct {
+		char *p;				/* bytes of text to send, or NULL for */
+		int offset;				/* ... body bytes from offset */
+		int len;
+	} parts[CACHE_MAX_PARTS];
+} cache_range;
+
+/* A miss being fetched, which other clients may tail as it arrives */
+typedef struct cache_fill {
+	char *url;
+	unsigned long hash;
+	char *headers;				/* response headers, as for a cache_block */
+	int hdrlen;
+	char *vary;					/* ... as are these */
+	char *variant;
+	char *data;					/* the body, once its size is known */
+	int size;					/* -1 until cache_fill_start */
+	int len;					/* bytes of data captured so far */
+	int done;					/* fetch over, waiters may look again */
+	int failed;					/* ... without the whole body */
+	int refcnt;					/* the fetcher and the waiting clients */
+	struct cache_waiter *waiters;
+	struct cache_fill *next;
+} cache_fill;
+
+void initCache(long cache_size, int object_size, int no_admission);
+cache_block *SearchNode(char *url, http_request *r, int again);
+int SearchNodeAsync(char *url, http_request *r, int again, cache_block **hit,
+					void (*done)(void *), void *arg);
+void ReleaseNode(cache_block *block);
+int FreshNode(cache_block *block);
+void RefreshNode(cache_block *block, time_t expires);
+cache_block *UpdateNode(cache_block *block, cache_meta *meta, int keep);
+void DropNode(cache_block *block);
+int SendData(int fd, cache_block *block, int keep_alive, int *pos);
+int cache_range_init(cache_range *rg, cache_block *block, http_request *r,
+					int keep_alive);
+int SendRange(int fd, cache_block *block, cache_range *rg, int *pos);
+void cache_range_free(cache_range *rg);
+void StoreData(char *url, http_request *r, char *data, int length,
+				cache_meta *meta);
+int cache_claim(char *url, http_request *r, cache_fill **fill,
+				void (*done)(void *), void *arg);
+int cache_attach(char *url, http_request *r, cache_fill **fill);
+char *cache_fill_start(cache_fill *f, http_request *r, char *vary,
+						char *headers, int hdrlen, int size);
+void cache_fill_grow(cache_fill *f, int len);
+void cache_fill_end(cache_fill *f, int complete);
+void ReleaseFill(cache_fill *f);
+int TailData(int fd, cache_fill *f, int keep_alive, int *pos,
+			void (*done)(void *), void *arg);
+void cache_print_stats(FILE *fp);
+
+#endif /* __CACHE_H__ */
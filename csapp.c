@@ -1,5 +1,8 @@
 /* $begin csapp.c */
 #include "csapp.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 /* Updated with a reentrant open_clientfd_r function */
 
@@ -582,13 +585,12 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
  *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ *    read() (in rio_fill) if the internal buffer is empty.
  */
 /* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+/* rio_fill - refill the internal buffer if it is empty; returns rio_cnt */
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
@@ -601,6 +603,15 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    if ((cnt = rio_fill(rp)) <= 0)
+	return cnt;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -653,29 +664,82 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Read up to n bytes, returning as soon as any are
+ *    available rather than waiting for all n (buffered)
+ */
+/* $begin rio_readsomeb */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    return rio_read(rp, usrbuf, n);	/* retries EINTR itself */
+}
+/* $end rio_readsomeb */
+
+/*
+ * rio_findnl - find the first newline in the n bytes at p, comparing 32
+ *    (AVX2) or 16 (SSE2) bytes at a time where the build allows
+ */
+static char *rio_findnl(char *p, size_t n)
+{
+#if defined(__AVX2__)
+    const __m256i nl = _mm256_set1_epi8('\n');
+    unsigned mask;
+
+    for (; n >= 32; p += 32, n -= 32) {
+	mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		   _mm256_loadu_si256((__m256i *)p), nl));
+	if (mask)
+	    return p + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n');
+    unsigned mask;
+
+    for (; n >= 16; p += 16, n -= 16) {
+	mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		   _mm_loadu_si128((__m128i *)p), nl));
+	if (mask)
+	    return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; n > 0; p++, n--)     /* scalar tail, or the whole scan */
+	if (*p == '\n')
+	    return p;
+    return NULL;
+}
+
 /* 
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_readlineb - robustly read a text line (buffered). Each refill of
+ *    the internal buffer is scanned for the newline in one pass and the
+ *    line copied out at once, rather than a byte at a time
+ * Returns the number of bytes read, 0 at EOF and -1 on error
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
 
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
+    while (nl == NULL && n < maxlen - 1) {
+	if ((rc = rio_fill(rp)) < 0)
 	    return -1;	  /* error */
+	if (rc == 0) {
+	    if (n == 0)
+		return 0; /* EOF, no data read */
+	    break;        /* EOF, some data was read */
+	}
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = rio_findnl(rp->rio_bufptr, cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = 0;
+    bufp[n] = 0;
     return n;
 }
 /* $end rio_readlineb */
@@ -801,12 +865,10 @@ int open_clientfd_r(char *hostname, int port) {
     }
 }
 
-/*  
- * open_listenfd - open and return a listening socket on port
- *     Returns -1 and sets errno on Unix error.
+/*
+ * open_listenfd_opt - open_listenfd, optionally with SO_REUSEPORT
  */
-/* $begin open_listenfd */
-int open_listenfd(int port) 
+static int open_listenfd_opt(int port, int reuseport)
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -820,6 +882,10 @@ int open_listenfd(int port)
 		   (const void *)&optval , sizeof(int)) < 0)
 	return -1;
 
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+				(const void *)&optval , sizeof(int)) < 0)
+	return -1;
+
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     bzero((char *) &serveraddr, sizeof(serveraddr));
@@ -834,8 +900,29 @@ int open_listenfd(int port)
 	return -1;
     return listenfd;
 }
+
+/*  
+ * open_listenfd - open and return a listening socket on port
+ *     Returns -1 and sets errno on Unix error.
+ */
+/* $begin open_listenfd */
+int open_listenfd(int port) 
+{
+    return open_listenfd_opt(port, 0);
+}
 /* $end open_listenfd */
 
+/*
+ * open_listenfd_reuseport - like open_listenfd, but with SO_REUSEPORT so
+ *     several sockets can listen on the same port and the kernel balances
+ *     new connections across them.
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_listenfd_reuseport(int port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
 /******************************************
  * Wrappers for the client/server helper routines 
  ******************************************/
@@ -870,6 +957,15 @@ int Open_listenfd(int port)
 	unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_listenfd_reuseport(int port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
 /* $end csapp.c */
 
 
@@ -147,6 +147,7 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t	rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
 /* Wrappers for Rio package */
@@ -160,11 +161,13 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 int open_clientfd(char *hostname, int portno);
 int open_clientfd_r(char *hostname, int portno);
 int open_listenfd(int portno);
+int open_listenfd_reuseport(int portno);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_clientfd_r(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_listenfd_reuseport(int port);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
@@ -0,0 +1,455 @@
+/*
+ * disk.c - on-disk second tier of the object cache
+ *
+ * Objects the cache stores are also appended to segment files in a
+ * directory, so that they survive a restart and the disk can hold far
+ * more than the memory segment. The directory holds up to DISK_SEGMENTS
+ * files of disk_size / DISK_SEGMENTS bytes, named by sequence number and
+ * written strictly in order: once the newest is full the oldest is
+ * deleted and a new one started, so space is reclaimed first-in,
+ * first-out without any compaction.
+ *
+ * A record is a disk_record followed by the URL, the validators, the
+ * Vary names and variant key, the stored headers and the body. Only one
+ * variant of a URL is kept, the one stored last. The index is a separate file of
+ * fixed-size slots mapped MAP_SHARED, so a restart only has to map it
+ * again to come back warm. It is set-associative: a hash may go in any
+ * of the DISK_WAYS slots of its set, a slot pointing into a deleted
+ * segment is free, and when none is the one pointing into the oldest
+ * segment is reused. A slot names no more than a record's segment,
+ * offset and length; the record itself is checked against the URL on
+ * every read, so one left dangling by a crash merely misses.
+ *
+ * Appends come from a single thread, the cache's disk writer, which is
+ * also the only one to rotate segments, so a record is written with no
+ * lock held, and reads are done with none held either: disk_lock covers
+ * just rotation and the index, and a reader pins the segment it reads by
+ * duplicating its descriptor under the lock. Whether a segment or a hash is still indexed
+ * can be asked without the lock at all, as a hint.
+ */
+#define _GNU_SOURCE
+#include <sys/uio.h>
+#include "csapp.h"
+#include "disk.h"
+
+#define DISK_SEGMENTS	16		/* files the disk budget is split into */
+#define DISK_WAYS		8		/* index slots a hash may go in */
+#define DISK_OBJECT		8192	/* bytes per object the index is sized for */
+#define DISK_MIN_SETS	1024
+#define DISK_MAX_SEG	(1L << 30)	/* offsets in the index are 32-bit */
+#define DISK_MAGIC		0x32585250	/* "PRX2" */
+
+/* The start of the index file; the slots follow */
+typedef struct {
+	unsigned int magic;
+	unsigned int nsets;
+	unsigned int first, last;	/* live segments, oldest and newest */
+	long segsize;
+} disk_header;
+
+typedef struct {
+	unsigned long hash;
+	unsigned int seg;			/* 0 if never used */
+	unsigned int offset;		/* of the record within the segment */
+	unsigned int length;		/* of the whole record */
+	unsigned int unused;
+} disk_slot;
+
+/* Heads each record; the strings' lengths count their NULs */
+typedef struct {
+	unsigned int magic;
+	unsigned int urllen, etaglen, modlen, varylen, variantlen;
+	unsigned int hdrlen, size;
+	long expires;
+} disk_record;
+
+static char *disk_dir;			/* NULL if there is no disk tier */
+static disk_header *index_hdr;	/* the mapped index */
+static disk_slot *slots;
+static int seg_fds[DISK_SEGMENTS];	/* live segments by number */
+static long seg_tail;			/* bytes written to the newest */
+static pthread_rwlock_t disk_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Counters, see disk_print_stats */
+static unsigned long nhits, nmisses, nstored;
+
+
+static void seg_path(char *buf, unsigned int seg)
+{
+	sprintf(buf, "%s/%08x.seg", disk_dir, seg);
+}
+
+static int seg_open(unsigned int seg, int flags)
+{
+	char path[MAXLINE];
+
+	seg_path(path, seg);
+	return open(path, O_RDWR | O_CLOEXEC | flags, 0644);
+}
+
+static void seg_unlink(unsigned int seg)
+{
+	char path[MAXLINE];
+
+	seg_path(path, seg);
+	unlink(path);
+}
+
+/*
+ * disk_init - keep up to disk_size bytes of objects in dir, picking up
+ *             whatever an earlier run left there if it used the same
+ *             size. Without a call there is no disk tier
+ */
+void disk_init(char *dir, long disk_size)
+{
+	char path[MAXLINE];
+	unsigned int nsets = DISK_MIN_SETS, seg;
+	long segsize = disk_size / DISK_SEGMENTS;
+	struct stat st;
+	size_t len;
+	int fd;
+
+	if (segsize > DISK_MAX_SEG)
+		segsize = DISK_MAX_SEG;
+	while ((long)nsets * DISK_WAYS < disk_size / DISK_OBJECT)
+		nsets *= 2;
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		unix_error("mkdir error");
+	disk_dir = strdup(dir);
+
+	len = sizeof(disk_header) + (size_t)nsets * DISK_WAYS * sizeof(disk_slot);
+	snprintf(path, sizeof(path), "%s/index", dir);
+	fd = Open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	Fstat(fd, &st);
+	if (ftruncate(fd, len) < 0)
+		unix_error("ftruncate error");
+	index_hdr = Mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	Close(fd);
+	slots = (disk_slot *)(index_hdr + 1);
+
+	if (st.st_size != len || index_hdr->magic != DISK_MAGIC ||
+		index_hdr->nsets != nsets || index_hdr->segsize != segsize) {
+		// Laid out for another size, or not at all: start cold
+		if (st.st_size == len && index_hdr->magic == DISK_MAGIC)
+			for (seg = index_hdr->first; seg <= index_hdr->last; seg++)
+				seg_unlink(seg);
+		memset(index_hdr, 0, len);
+		index_hdr->magic = DISK_MAGIC;
+		index_hdr->nsets = nsets;
+		index_hdr->first = index_hdr->last = 1;
+		index_hdr->segsize = segsize;
+		fd = seg_open(1, O_CREAT | O_TRUNC);
+		if (fd < 0)
+			unix_error("open error");
+		Close(fd);
+	}
+	for (seg = index_hdr->first; seg <= index_hdr->last; seg++)
+		seg_fds[seg % DISK_SEGMENTS] =		// -1 if gone: its objects miss
+			seg_open(seg, seg == index_hdr->last ? O_CREAT : 0);
+	if ((fd = seg_fds[index_hdr->last % DISK_SEGMENTS]) < 0)
+		unix_error("open error");
+	Fstat(fd, &st);
+	seg_tail = st.st_size;
+}
+
+static disk_slot *set_of(unsigned long hash)
+{
+	return &slots[(hash & (index_hdr->nsets - 1)) * DISK_WAYS];
+}
+
+static int live(disk_slot *s)
+{
+	return s->seg >= index_hdr->first && s->seg <= index_hdr->last;
+}
+
+/*
+ * slot_for - the slot to index a record for hash in: the one already
+ *            holding hash, else a free one, else the oldest; disk_lock
+ *            must be held for writing
+ */
+static disk_slot *slot_for(unsigned long hash)
+{
+	disk_slot *set = set_of(hash), *oldest = set;
+	int i;
+
+	for (i = 0; i < DISK_WAYS; i++)
+		if (set[i].hash == hash && live(&set[i]))
+			return &set[i];
+	for (i = 0; i < DISK_WAYS; i++) {
+		if (!live(&set[i]))
+			return &set[i];
+		if (set[i].seg < oldest->seg)
+			oldest = &set[i];
+	}
+	return oldest;
+}
+
+/*
+ * seg_rotate - start a new segment, deleting the oldest if all are in
+ *              use; disk_lock must be held for writing
+ * Returns -1 if the new one cannot be created
+ */
+static int seg_rotate(void)
+{
+	unsigned int seg = index_hdr->last + 1, old = index_hdr->first;
+	int fd;
+
+	if (seg - old >= DISK_SEGMENTS) {
+		// Retire it in the index first, so nothing points into it
+		__atomic_store_n(&index_hdr->first, old + 1, __ATOMIC_RELEASE);
+		if (seg_fds[old % DISK_SEGMENTS] >= 0)
+			Close(seg_fds[old % DISK_SEGMENTS]);
+		seg_fds[old % DISK_SEGMENTS] = -1;
+		seg_unlink(old);
+	}
+	if ((fd = seg_open(seg, O_CREAT | O_TRUNC)) < 0)
+		return -1;
+	seg_fds[seg % DISK_SEGMENTS] = fd;
+	index_hdr->last = seg;
+	seg_tail = 0;
+	return 0;
+}
+
+/*
+ * disk_store - append an object to the newest segment and index it, as
+ *              StoreData would keep it: meta's headers then framing, then
+ *              the body. Never called by two threads at once
+ * Returns the segment it went to, 0 if it was not stored
+ */
+unsigned int disk_store(char *url, unsigned long hash, cache_meta *meta,
+						char *framing, char *data, int length)
+{
+	char *strings[5] = { url, meta->etag, meta->modified, meta->vary,
+						meta->variant };
+	unsigned int *lens[5];
+	disk_record rec;
+	struct iovec iov[9];
+	unsigned int seg;
+	disk_slot *s;
+	long reclen = sizeof(rec), offset;
+	int i, fd;
+
+	if (disk_dir == NULL)
+		return 0;
+	rec.magic = DISK_MAGIC;
+	lens[0] = &rec.urllen;
+	lens[1] = &rec.etaglen;
+	lens[2] = &rec.modlen;
+	lens[3] = &rec.varylen;
+	lens[4] = &rec.variantlen;
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	for (i = 0; i < 5; i++) {
+		iov[i + 1].iov_base = strings[i] ? strings[i] : "";
+		reclen += iov[i + 1].iov_len = *lens[i] =
+			strlen(iov[i + 1].iov_base) + 1;
+	}
+	rec.hdrlen = meta->hdrlen + strlen(framing);
+	rec.size = length;
+	rec.expires = meta->expires;
+	iov[6].iov_base = meta->headers;
+	iov[6].iov_len = meta->hdrlen;
+	iov[7].iov_base = framing;
+	iov[7].iov_len = strlen(framing);
+	iov[8].iov_base = data;
+	iov[8].iov_len = length;
+	reclen += rec.hdrlen + length;
+	if (reclen > index_hdr->segsize)
+		return 0;
+
+	pthread_rwlock_wrlock(&disk_lock);
+	if (seg_tail + reclen > index_hdr->segsize && seg_rotate() < 0) {
+		pthread_rwlock_unlock(&disk_lock);
+		return 0;
+	}
+	seg = index_hdr->last;
+	fd = seg_fds[seg % DISK_SEGMENTS];
+	offset = seg_tail;
+	pthread_rwlock_unlock(&disk_lock);
+
+	// Only this thread rotates, so the segment stays open meanwhile. A
+	// failed write leaves the tail where it was, to be written over
+	if (pwritev(fd, iov, 9, offset) != reclen)
+		return 0;
+	pthread_rwlock_wrlock(&disk_lock);
+	s = slot_for(hash);
+	s->hash = hash;
+	s->seg = seg;
+	s->offset = offset;
+	s->length = reclen;
+	seg_tail += reclen;
+	nstored++;
+	pthread_rwlock_unlock(&disk_lock);
+	return seg;
+}
+
+/*
+ * take_string - the NUL-terminated string of len bytes at *p, which is
+ *               advanced past it, or NULL if it is not one
+ */
+static char *take_string(char **p, unsigned int len)
+{
+	char *s = *p;
+
+	*p += len;
+	return len > 0 && s[len - 1] == '\0' ? s : NULL;
+}
+
+/*
+ * parse_record - check that the length bytes of p are a whole record
+ *                of url, and fill in obj from it
+ */
+static int parse_record(char *p, long length, char *url, disk_object *obj)
+{
+	disk_record *rec = (disk_record *)p;
+	char *s = p + sizeof(disk_record), *u;
+
+	if (length < sizeof(disk_record) || rec->magic != DISK_MAGIC ||
+		sizeof(disk_record) + (long)rec->urllen + rec->etaglen + rec->modlen
+		+ rec->varylen + rec->variantlen + rec->hdrlen + rec->size != length)
+		return 0;
+	if ((u = take_string(&s, rec->urllen)) == NULL || strcmp(u, url) ||
+		(obj->meta.etag = take_string(&s, rec->etaglen)) == NULL ||
+		(obj->meta.modified = take_string(&s, rec->modlen)) == NULL ||
+		(obj->meta.vary = take_string(&s, rec->varylen)) == NULL ||
+		(obj->meta.variant = take_string(&s, rec->variantlen)) == NULL)
+		return 0;
+	obj->record = p;
+	obj->meta.headers = s;
+	obj->meta.hdrlen = rec->hdrlen;
+	obj->meta.expires = rec->expires;
+	obj->data = s + rec->hdrlen;
+	obj->size = rec->size;
+	return 1;
+}
+
+/*
+ * find_slot - the live slot indexing hash; disk_lock must be held
+ * Returns NULL if there is none
+ */
+static disk_slot *find_slot(unsigned long hash)
+{
+	disk_slot *set = set_of(hash);
+	int i;
+
+	for (i = 0; i < DISK_WAYS; i++)
+		if (set[i].hash == hash && live(&set[i]))
+			return &set[i];
+	return NULL;
+}
+
+/*
+ * disk_lookup - read url back from disk into obj. The read is done with
+ *               disk_lock released, from a duplicate of the segment's
+ *               descriptor that keeps it readable should it be rotated
+ *               out meanwhile, and counts only if the slot still points
+ *               at the same record afterwards
+ * Returns 1 if it was there, 0 otherwise
+ */
+int disk_lookup(char *url, unsigned long hash, disk_object *obj)
+{
+	disk_slot *slot, s;
+	char *p = NULL;
+	int fd = -1, found = 0;
+
+	if (disk_dir == NULL)
+		return 0;
+	pthread_rwlock_rdlock(&disk_lock);
+	if ((slot = find_slot(hash)) != NULL) {
+		s = *slot;
+		if (seg_fds[s.seg % DISK_SEGMENTS] >= 0)
+			fd = fcntl(seg_fds[s.seg % DISK_SEGMENTS], F_DUPFD_CLOEXEC, 0);
+	}
+	pthread_rwlock_unlock(&disk_lock);
+	if (fd >= 0) {
+		p = Malloc(s.length);
+		found = pread(fd, p, s.length, s.offset) == s.length &&
+				parse_record(p, s.length, url, obj);
+		close(fd);
+	}
+	if (found) {				// not forgotten or rotated out meanwhile
+		pthread_rwlock_rdlock(&disk_lock);
+		slot = find_slot(hash);
+		found = slot && slot->seg == s.seg && slot->offset == s.offset;
+		pthread_rwlock_unlock(&disk_lock);
+	}
+	if (!found) {
+		free(p);
+		__atomic_fetch_add(&nmisses, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	obj->seg = s.seg;
+	__atomic_fetch_add(&nhits, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * disk_enabled - whether there is a disk tier
+ */
+int disk_enabled(void)
+{
+	return disk_dir != NULL;
+}
+
+/*
+ * disk_holds - whether what disk_store put in segment seg is still there
+ */
+int disk_holds(unsigned int seg)
+{
+	if (disk_dir == NULL)
+		return 1;				// nothing would be kept anyway
+	return seg != 0 &&
+		seg >= __atomic_load_n(&index_hdr->first, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * disk_probe - whether an object may be indexed under hash. The index is
+ *              read without the lock, so the answer is only a hint
+ */
+int disk_probe(unsigned long hash)
+{
+	disk_slot *set;
+	unsigned int first;
+	int i;
+
+	if (disk_dir == NULL)
+		return 0;
+	set = set_of(hash);
+	first = __atomic_load_n(&index_hdr->first, __ATOMIC_ACQUIRE);
+	for (i = 0; i < DISK_WAYS; i++)
+		if (__atomic_load_n(&set[i].hash, __ATOMIC_RELAXED) == hash &&
+			__atomic_load_n(&set[i].seg, __ATOMIC_RELAXED) >= first)
+			return 1;
+	return 0;
+}
+
+/*
+ * disk_forget - drop the object indexed under hash, which the server no
+ *               longer lets the cache keep
+ */
+void disk_forget(unsigned long hash)
+{
+	disk_slot *set;
+	int i;
+
+	if (disk_dir == NULL)
+		return;
+	pthread_rwlock_wrlock(&disk_lock);
+	set = set_of(hash);
+	for (i = 0; i < DISK_WAYS; i++)
+		if (set[i].hash == hash && live(&set[i]))
+			set[i].seg = 0;
+	pthread_rwlock_unlock(&disk_lock);
+}
+
+void disk_print_stats(FILE *fp)
+{
+	if (disk_dir == NULL)
+		return;
+	pthread_rwlock_rdlock(&disk_lock);
+	fprintf(fp, "disk: %lu hits, %lu misses, %lu stored, %u segments of "
+			"%ld bytes in %s\n", nhits, nmisses, nstored,
+			index_hdr->last - index_hdr->first + 1, index_hdr->segsize,
+			disk_dir);
+	pthread_rwlock_unlock(&disk_lock);
+}
@@ -0,0 +1,29 @@
+/*
+ * disk.h - on-disk second tier of the object cache
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdio.h>
+#include "cache.h"
+
+/* An object read back from disk */
+typedef struct {
+	char *record;				/* holds all of it; Free() when done */
+	cache_meta meta;			/* headers include the framing */
+	char *data;
+	int size;
+	unsigned int seg;			/* where it lives, see disk_holds */
+} disk_object;
+
+void disk_init(char *dir, long disk_size);
+unsigned int disk_store(char *url, unsigned long hash, cache_meta *meta,
+						char *framing, char *data, int length);
+int disk_lookup(char *url, unsigned long hash, disk_object *obj);
+int disk_enabled(void);
+int disk_holds(unsigned int seg);
+int disk_probe(unsigned long hash);
+void disk_forget(unsigned long hash);
+void disk_print_stats(FILE *fp);
+
+#endif /* __DISK_H__ */
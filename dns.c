@@ -0,0 +1,581 @@
+/*
+ * dns.c - caching hostname resolver
+ *
+ * Resolved addresses are cached per hostname for ttl seconds, and failed
+ * lookups for a shorter negative TTL. getaddrinfo() does not report the
+ * records' own TTLs, so the lifetime is configured rather than taken
+ * from the answer. Once an entry expires it is still served for up to
+ * DNS_STALE seconds while a resolver thread refreshes it in the
+ * background, so hot hostnames never stall a request. Past that it is
+ * of no further use, and is reclaimed by the next lookup that walks its
+ * bucket, so the table holds only hostnames in recent use.
+ *
+ * Concurrent misses on one hostname share a single lookup. dns_lookup()
+ * waits for it; dns_lookup_async() instead hands the lookup to the
+ * resolver threads and calls back when it completes, which lets an event
+ * loop keep running in the meantime.
+ *
+ * Connections are dialed Happy Eyeballs style (RFC 8305): the addresses
+ * are tried alternating between IPv6 and IPv4, starting with the family
+ * getaddrinfo() put first, and each attempt gets DNS_ATTEMPT_DELAY ms
+ * before the next one starts alongside it, or at once if it fails. The
+ * first to connect wins, and the dial gives up after connect_timeout
+ * seconds in all, so a dead or unreachable address costs a fraction of a
+ * second rather than the kernel's minutes-long connect timeout. A dial
+ * never blocks: its attempts and its timer sit in an epoll set of their
+ * own, whose descriptor an event loop can wait on with everything else.
+ */
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include "csapp.h"
+#include "dns.h"
+
+#define DNS_BUCKETS		1024	/* hash buckets of hostnames */
+#define DNS_NEGATIVE	5		/* max seconds a failed lookup is cached */
+#define DNS_STALE		30		/* seconds an expired entry may be served */
+#define DNS_THREADS		4		/* resolver threads */
+#define DNS_ATTEMPT_DELAY 250	/* ms before racing the next address */
+
+/* A lookup waiting for its answer */
+typedef struct dns_waiter {
+	dns_addrs *out;
+	void (*done)(void *);
+	void *arg;
+	struct dns_waiter *next;
+} dns_waiter;
+
+typedef struct dns_entry {
+	char *hostname;
+	dns_addrs addrs;
+	int valid;					/* addrs holds an answer */
+	time_t expires;				/* fresh until then */
+	int resolving;				/* a lookup is in progress */
+	dns_waiter *waiters;		/* async lookups waiting for it */
+	pthread_cond_t resolved;	/* signalled when it completes */
+	int nblocked;				/* threads waiting on resolved */
+	struct dns_entry *next;		/* bucket chain */
+	struct dns_entry *qnext;	/* resolver queue link */
+} dns_entry;
+
+static struct {
+	pthread_mutex_t lock;
+	dns_entry *head;
+} buckets[DNS_BUCKETS];
+
+static int dns_ttl;
+
+/* Entries waiting for a resolver thread */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static dns_entry *queue_head, *queue_tail;
+static pthread_once_t resolvers_once = PTHREAD_ONCE_INIT;
+
+/* Counters, see dns_print_stats */
+static unsigned long nhits, nstale, nnegative, nmisses;
+static unsigned long nconnects, nfallbacks, ntimeouts;
+static unsigned long nentries;	/* hostnames in the table */
+
+static int connect_timeout;		/* seconds a dial may take in all */
+
+
+void dns_init(int ttl, int timeout)
+{
+	int i;
+
+	dns_ttl = ttl;
+	connect_timeout = timeout;
+	for (i = 0; i < DNS_BUCKETS; i++) {
+		pthread_mutex_init(&buckets[i].lock, NULL);
+		buckets[i].head = NULL;
+	}
+}
+
+static unsigned dns_hash(char *hostname)
+{
+	unsigned h = 0;
+
+	while (*hostname)
+		h = h * 31 + tolower((unsigned char)*hostname++);
+	return h % DNS_BUCKETS;
+}
+
+/*
+ * expired - whether e is past serving even stale and nobody is using it
+ */
+static int expired(dns_entry *e, time_t now)
+{
+	return e->valid && now >= e->expires + DNS_STALE && !e->resolving &&
+		e->waiters == NULL && e->nblocked == 0;
+}
+
+/*
+ * find_entry - look up (or add) the entry for hostname, freeing expired
+ *              entries met along the way; the bucket lock must be held
+ */
+static dns_entry *find_entry(unsigned b, char *hostname)
+{
+	dns_entry *e, **pp;
+	time_t now = time(NULL);
+
+	for (pp = &buckets[b].head; (e = *pp) != NULL; ) {
+		if (!strcasecmp(e->hostname, hostname))
+			return e;
+		if (expired(e, now)) {
+			*pp = e->next;
+			pthread_cond_destroy(&e->resolved);
+			free(e->hostname);
+			Free(e);
+			__atomic_fetch_sub(&nentries, 1, __ATOMIC_RELAXED);
+		}
+		else
+			pp = &e->next;
+	}
+	e = Calloc(1, sizeof(dns_entry));
+	e->hostname = strdup(hostname);
+	pthread_cond_init(&e->resolved, NULL);
+	e->next = buckets[b].head;
+	buckets[b].head = e;
+	__atomic_fetch_add(&nentries, 1, __ATOMIC_RELAXED);
+	return e;
+}
+
+/*
+ * resolve - run the blocking lookup itself
+ */
+static void resolve(char *hostname, dns_addrs *out)
+{
+	struct addrinfo hints, *addlist, *p;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	out->naddrs = 0;
+	if (getaddrinfo(hostname, NULL, &hints, &addlist) != 0)
+		return;
+	for (p = addlist; p && out->naddrs < DNS_MAX_ADDRS; p = p->ai_next) {
+		memcpy(&out->addrs[out->naddrs], p->ai_addr, p->ai_addrlen);
+		out->addrlens[out->naddrs++] = p->ai_addrlen;
+	}
+	freeaddrinfo(addlist);
+}
+
+/*
+ * complete - record the answer for e and wake everyone waiting for it;
+ *            the bucket lock must be held. Returns the async waiters,
+ *            whose callbacks the caller runs after dropping the lock
+ */
+static dns_waiter *complete(dns_entry *e, dns_addrs *answer)
+{
+	dns_waiter *w, *waiters = e->waiters;
+
+	e->addrs = *answer;
+	e->valid = 1;
+	e->expires = time(NULL) + (answer->naddrs ? dns_ttl :
+								(dns_ttl < DNS_NEGATIVE ? dns_ttl : DNS_NEGATIVE));
+	e->resolving = 0;
+	e->waiters = NULL;
+	for (w = waiters; w; w = w->next)
+		*w->out = e->addrs;
+	pthread_cond_broadcast(&e->resolved);
+	return waiters;
+}
+
+static void notify(dns_waiter *w)
+{
+	dns_waiter *next;
+
+	for (; w; w = next) {
+		next = w->next;
+		w->done(w->arg);
+		Free(w);
+	}
+}
+
+/*
+ * resolver - thread serving queued lookups
+ */
+static void *resolver(void *vargp)
+{
+	dns_entry *e;
+	dns_addrs answer;
+	dns_waiter *w;
+	unsigned b;
+
+	Pthread_detach(Pthread_self());
+	while (1) {
+		pthread_mutex_lock(&queue_lock);
+		while ((e = queue_head) == NULL)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		if ((queue_head = e->qnext) == NULL)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		resolve(e->hostname, &answer);
+		b = dns_hash(e->hostname);
+		pthread_mutex_lock(&buckets[b].lock);
+		w = complete(e, &answer);
+		pthread_mutex_unlock(&buckets[b].lock);
+		notify(w);
+	}
+	return NULL;
+}
+
+static void start_resolvers(void)
+{
+	pthread_t tid;
+	int i;
+
+	for (i = 0; i < DNS_THREADS; i++)
+		Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+/*
+ * enqueue - hand e to the resolver threads; e->resolving must already be
+ *           set so it is queued only once
+ */
+static void enqueue(dns_entry *e)
+{
+	pthread_once(&resolvers_once, start_resolvers);
+	pthread_mutex_lock(&queue_lock);
+	e->qnext = NULL;
+	if (queue_tail)
+		queue_tail->qnext = e;
+	else
+		queue_head = e;
+	queue_tail = e;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * cached - answer from e if it is fresh, or stale but still servable (in
+ *          which case a refresh is started); the bucket lock must be held
+ * Returns 1 if *out was filled in
+ */
+static int cached(dns_entry *e, dns_addrs *out)
+{
+	time_t now = time(NULL);
+
+	if (!e->valid)
+		return 0;
+	if (now < e->expires) {
+		__atomic_fetch_add(e->addrs.naddrs ? &nhits : &nnegative, 1,
+							__ATOMIC_RELAXED);
+	}
+	else if (e->addrs.naddrs && now < e->expires + DNS_STALE) {
+		__atomic_fetch_add(&nstale, 1, __ATOMIC_RELAXED);
+		if (!e->resolving) {
+			e->resolving = 1;
+			enqueue(e);
+		}
+	}
+	else
+		return 0;
+	*out = e->addrs;
+	return 1;
+}
+
+/*
+ * dns_lookup - resolve hostname, waiting for the lookup on a miss
+ * Returns the number of addresses, 0 if the name does not resolve
+ */
+int dns_lookup(char *hostname, dns_addrs *out)
+{
+	unsigned b = dns_hash(hostname);
+	dns_entry *e;
+	dns_addrs answer;
+	dns_waiter *w = NULL;
+
+	pthread_mutex_lock(&buckets[b].lock);
+	e = find_entry(b, hostname);
+	if (!cached(e, out)) {
+		__atomic_fetch_add(&nmisses, 1, __ATOMIC_RELAXED);
+		if (e->resolving) {		// someone else is already looking it up
+			e->nblocked++;
+			while (e->resolving)
+				pthread_cond_wait(&e->resolved, &buckets[b].lock);
+			e->nblocked--;
+		}
+		else {
+			e->resolving = 1;
+			pthread_mutex_unlock(&buckets[b].lock);
+			resolve(hostname, &answer);
+			pthread_mutex_lock(&buckets[b].lock);
+			w = complete(e, &answer);
+		}
+		*out = e->addrs;
+	}
+	pthread_mutex_unlock(&buckets[b].lock);
+	notify(w);
+	return out->naddrs;
+}
+
+/*
+ * dns_lookup_async - resolve hostname without blocking. On a miss the
+ *                    lookup runs on a resolver thread, which fills in
+ *                    *out and then calls done(arg)
+ * Returns DNS_DONE or DNS_PENDING
+ */
+int dns_lookup_async(char *hostname, dns_addrs *out,
+					void (*done)(void *), void *arg)
+{
+	unsigned b = dns_hash(hostname);
+	dns_entry *e;
+	dns_waiter *w;
+
+	pthread_mutex_lock(&buckets[b].lock);
+	e = find_entry(b, hostname);
+	if (cached(e, out)) {
+		pthread_mutex_unlock(&buckets[b].lock);
+		return DNS_DONE;
+	}
+	__atomic_fetch_add(&nmisses, 1, __ATOMIC_RELAXED);
+	w = Malloc(sizeof(dns_waiter));
+	w->out = out;
+	w->done = done;
+	w->arg = arg;
+	w->next = e->waiters;
+	e->waiters = w;
+	if (!e->resolving) {
+		e->resolving = 1;
+		enqueue(e);
+	}
+	pthread_mutex_unlock(&buckets[b].lock);
+	return DNS_PENDING;
+}
+
+/*
+ * open_addr - open a non-blocking socket to addrs->addrs[i] at port and
+ *             start connecting it
+ * Returns -1 if the connect failed at once
+ */
+static int open_addr(dns_addrs *addrs, int i, int port)
+{
+	struct sockaddr_storage sa = addrs->addrs[i];
+	int fd;
+
+	if (sa.ss_family == AF_INET)
+		((struct sockaddr_in *)&sa)->sin_port = htons(port);
+	else if (sa.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&sa)->sin6_port = htons(port);
+	else
+		return -1;
+	if ((fd = socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		return -1;
+	if (connect(fd, (SA *)&sa, addrs->addrlens[i]) == 0 ||
+		errno == EINPROGRESS)
+		return fd;
+	close(fd);
+	return -1;
+}
+
+/*
+ * now_ms - the monotonic clock in milliseconds
+ */
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * interleave - order d's addresses alternating between families, those
+ *              of the first address's family first
+ */
+static void interleave(dns_dialer *d)
+{
+	int same[DNS_MAX_ADDRS], other[DNS_MAX_ADDRS];
+	int i, a = 0, b = 0, nsame = 0, nother = 0;
+	dns_addrs *addrs = d->addrs;
+
+	for (i = 0; i < addrs->naddrs; i++)
+		if (addrs->addrs[i].ss_family == addrs->addrs[0].ss_family)
+			same[nsame++] = i;
+		else
+			other[nother++] = i;
+	for (i = 0; i < addrs->naddrs; i++)
+		d->order[i] = (i % 2 == 0 && a < nsame) || b == nother ?
+					same[a++] : other[b++];
+}
+
+/*
+ * dial_next - start the next attempt that gets as far as connecting, if
+ *             any address is left, and set the timer for the one after
+ *             it, or else for the deadline
+ */
+static void dial_next(dns_dialer *d)
+{
+	struct epoll_event ev;
+	struct itimerspec its;
+	long when = d->deadline;
+	int i, fd;
+
+	while (d->next < d->addrs->naddrs) {
+		i = d->order[d->next++];
+		if ((fd = open_addr(d->addrs, i, d->port)) < 0)
+			continue;
+		ev.events = EPOLLOUT;
+		ev.data.u32 = i;
+		if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			continue;
+		}
+		d->fds[i] = fd;
+		d->inflight++;
+		d->started = now_ms();
+		break;
+	}
+	if (d->next < d->addrs->naddrs && d->started + DNS_ATTEMPT_DELAY < when)
+		when = d->started + DNS_ATTEMPT_DELAY;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = when / 1000;
+	its.it_value.tv_nsec = when % 1000 * 1000000;
+	timerfd_settime(d->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * dns_dial_start - begin dialing addrs at port
+ * Returns the descriptor that becomes readable whenever dns_dial_poll
+ * has something to do, or -1 if no attempt could be started
+ */
+int dns_dial_start(dns_dialer *d, dns_addrs *addrs, int port)
+{
+	struct epoll_event ev;
+	int i;
+
+	d->addrs = addrs;
+	d->port = port;
+	d->next = d->inflight = 0;
+	d->started = now_ms();
+	d->deadline = d->started + connect_timeout * 1000L;
+	for (i = 0; i < DNS_MAX_ADDRS; i++)
+		d->fds[i] = -1;
+	interleave(d);
+	d->timerfd = -1;
+	if ((d->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+		(d->timerfd = timerfd_create(CLOCK_MONOTONIC,
+									TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+		dns_dial_end(d);
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = DNS_MAX_ADDRS;		// not an address: the timer
+	epoll_ctl(d->epfd, EPOLL_CTL_ADD, d->timerfd, &ev);
+	dial_next(d);
+	if (d->inflight == 0) {
+		dns_dial_end(d);
+		return -1;
+	}
+	return d->epfd;
+}
+
+/*
+ * dns_dial_poll - move the dial on without blocking: take the outcome of
+ *                 attempts that have finished, and start the next one if
+ *                 it is due
+ * Returns the connected (non-blocking) socket, which the caller now owns,
+ * DNS_DIAL_AGAIN if the dial is still going, or -1 if it has failed, with
+ * errno ETIMEDOUT if it ran out of time
+ */
+int dns_dial_poll(dns_dialer *d)
+{
+	struct epoll_event events[DNS_MAX_ADDRS + 1];
+	uint64_t expirations;
+	socklen_t len;
+	int i, k, n, fd, err;
+
+	while ((n = epoll_wait(d->epfd, events, DNS_MAX_ADDRS + 1, 0)) > 0)
+		for (k = 0; k < n; k++) {
+			if ((i = events[k].data.u32) == DNS_MAX_ADDRS) {
+				if (read(d->timerfd, &expirations, sizeof(expirations)) < 0)
+					continue;
+				if (now_ms() >= d->deadline) {
+					__atomic_fetch_add(&ntimeouts, 1, __ATOMIC_RELAXED);
+					errno = ETIMEDOUT;
+					return -1;
+				}
+				dial_next(d);
+				continue;
+			}
+			if ((fd = d->fds[i]) < 0)
+				continue;
+			epoll_ctl(d->epfd, EPOLL_CTL_DEL, fd, NULL);
+			d->fds[i] = -1;
+			d->inflight--;
+			len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+				err == 0) {
+				__atomic_fetch_add(i == d->order[0] ? &nconnects :
+								&nfallbacks, 1, __ATOMIC_RELAXED);
+				return fd;
+			}
+			close(fd);
+			dial_next(d);			// failed: the next need not wait
+		}
+	if (d->inflight == 0 && d->next == d->addrs->naddrs) {
+		errno = ECONNREFUSED;
+		return -1;
+	}
+	return DNS_DIAL_AGAIN;
+}
+
+/*
+ * dns_dial_end - close what is left of a dial, its losing attempts
+ *                included; nothing if it is already over
+ */
+void dns_dial_end(dns_dialer *d)
+{
+	int i;
+
+	if (d->epfd < 0)
+		return;
+	for (i = 0; i < DNS_MAX_ADDRS; i++)
+		if (d->fds[i] >= 0) {
+			close(d->fds[i]);
+			d->fds[i] = -1;
+		}
+	if (d->timerfd >= 0)
+		close(d->timerfd);
+	close(d->epfd);
+	d->epfd = d->timerfd = -1;
+}
+
+/*
+ * dns_open_clientfd - open_clientfd_r through the cache, dialing as
+ *                     above and waiting for the outcome
+ * Returns a blocking socket, or -1 if the dial failed
+ */
+int dns_open_clientfd(char *hostname, int port)
+{
+	dns_addrs addrs;
+	dns_dialer d;
+	struct pollfd p;
+	int fd;
+
+	dns_lookup(hostname, &addrs);
+	if ((p.fd = dns_dial_start(&d, &addrs, port)) < 0)
+		return -1;
+	p.events = POLLIN;
+	while ((fd = dns_dial_poll(&d)) == DNS_DIAL_AGAIN)
+		if (poll(&p, 1, -1) < 0 && errno != EINTR) {
+			fd = -1;
+			break;
+		}
+	dns_dial_end(&d);
+	if (fd >= 0)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	return fd;
+}
+
+void dns_print_stats(FILE *fp)
+{
+	fprintf(fp, "dns: %lu hits, %lu stale hits, %lu negative hits, "
+			"%lu misses, %lu hostnames cached\n", nhits, nstale, nnegative,
+			nmisses, nentries);
+	fprintf(fp, "dial: %lu connects, %lu to a fallback address, "
+			"%lu timed out\n", nconnects, nfallbacks, ntimeouts);
+}
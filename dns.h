@@ -0,0 +1,50 @@
+/*
+ * dns.h - caching hostname resolver
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define DNS_MAX_ADDRS 8		/* addresses kept per hostname */
+
+/* Addresses of a hostname, without a port; naddrs == 0 if it has none */
+typedef struct {
+	int naddrs;
+	struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+	socklen_t addrlens[DNS_MAX_ADDRS];
+} dns_addrs;
+
+/* Return values of dns_lookup_async */
+#define DNS_DONE	0		/* *out is filled in */
+#define DNS_PENDING	1		/* done(arg) will be called once it is */
+
+/* Returned by dns_dial_poll while the dial is still going */
+#define DNS_DIAL_AGAIN	-2
+
+/* A connection being dialed, racing the addresses of a hostname */
+typedef struct {
+	int epfd;					/* readable as the race moves on; -1 if over */
+	int timerfd;				/* fires when the next attempt is due */
+	dns_addrs *addrs;
+	int port;
+	int order[DNS_MAX_ADDRS];	/* addresses to try, families interleaved */
+	int next;					/* ... the next of them */
+	int fds[DNS_MAX_ADDRS];		/* attempts by address, -1 if none */
+	int inflight;
+	long started;				/* ms, when the last attempt began */
+	long deadline;				/* ms, when the dial gives up */
+} dns_dialer;
+
+void dns_init(int ttl, int connect_timeout);
+int dns_lookup(char *hostname, dns_addrs *out);
+int dns_lookup_async(char *hostname, dns_addrs *out,
+					void (*done)(void *), void *arg);
+int dns_open_clientfd(char *hostname, int port);
+int dns_dial_start(dns_dialer *d, dns_addrs *addrs, int port);
+int dns_dial_poll(dns_dialer *d);
+void dns_dial_end(dns_dialer *d);
+void dns_print_stats(FILE *fp);
+
+#endif /* __DNS_H__ */
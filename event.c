@@ -0,0 +1,1252 @@
+/*
+ * event.c - edge-triggered epoll engine for the proxy
+ *
+ * An opt-in alternative to one thread per connection. Each loop thread
+ * owns an epoll instance and multiplexes many connections over it, so the
+ * number of clients is bounded by memory rather than by threads. Every
+ * connection is driven by a small state machine:
+ *
+ *   READ_REQUEST -> LOOKUP -> RESOLVE -> CONNECT -> SEND_REQUEST
+ *                -> RELAY_HEADERS -> RELAY_BODY
+ *
+ * Cache hits go from LOOKUP, and errors from any state, to WRITE_CLIENT.
+ * A miss goes straight to SEND_REQUEST on an idle pooled connection to
+ * the server when there is one, and the connection goes back to the pool
+ * once a response with exact framing has been read from it.
+ * Stale hits are revalidated with the server, and go from RELAY_HEADERS
+ * to WRITE_CLIENT if it answers 304.
+ * A miss on a URL another connection is already fetching tails that
+ * fetch's body from WRITE_CLIENT as it arrives, or, until its length is
+ * known, waits in LOOKUP. Hostnames missing from the DNS
+ * cache are resolved on the resolver threads, and objects missing from
+ * memory but perhaps on disk are read back on the cache's disk threads.
+ * Either way the connection is posted back to its loop through an
+ * eventfd.
+ * A persistent client connection returns to READ_REQUEST after each
+ * response; idle ones are swept once they exceed idle_timeout. The same
+ * sweep gives up on servers that have gone server_timeout without any
+ * progress in SEND_REQUEST, RELAY_HEADERS or RELAY_BODY: with a 504 if
+ * the response has not begun, otherwise by closing the connection.
+ * Bodies that are not being cached are spliced from the server to the
+ * client through a per-connection pipe instead of passing through buf.
+ * Sockets are non-blocking and registered once for both directions with
+ * EPOLLET, so every wakeup simply re-drives the state machine until it
+ * blocks on EAGAIN.
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "dns.h"
+#include "upstream.h"
+#include "event.h"
+
+#define EV_MAX_EVENTS	256			/* events handled per epoll_wait */
+#define EV_REQBUF		MAXLINE			/* max size of a request head */
+#define EV_SPLICE_LEN	65536			/* bytes moved per splice() */
+
+typedef enum {
+	CONN_READ_REQUEST,
+	CONN_LOOKUP,
+	CONN_RESOLVE,
+	CONN_CONNECT,
+	CONN_SEND_REQUEST,
+	CONN_RELAY_HEADERS,
+	CONN_RELAY_BODY,
+	CONN_WRITE_CLIENT,
+	CONN_DONE
+} conn_state;
+
+/* Where a chunked body's scanner is in the chunk framing */
+typedef enum {
+	CHUNK_SIZE,				/* reading the hex chunk size */
+	CHUNK_EXT,				/* skipping extensions to the end of the line */
+	CHUNK_DATA,				/* chunk_left data bytes to go */
+	CHUNK_DATA_END,			/* the CRLF after the data */
+	CHUNK_TRAILER,			/* trailer lines up to a blank one */
+	CHUNK_DONE
+} chunk_state;
+
+/* Return values of the state machine steps */
+#define STEP_AGAIN	0	/* blocked on EAGAIN, wait for the next event */
+#define STEP_NEXT	1	/* state changed, keep driving */
+
+struct conn;
+struct ev_loop;
+
+/* Connections waiting on a client or a server, oldest first */
+typedef struct {
+	struct conn *head, *tail;
+} conn_list;
+
+/* A registered descriptor, pointed to by its epoll_data */
+typedef struct {
+	struct conn *conn;					/* NULL for the loop's eventfd */
+	int fd;
+} ev_side;
+
+typedef struct conn {
+	conn_state state;
+	struct ev_loop *loop;
+	ev_side client, server;
+	char *uri;						/* the request's cache key */
+	dns_addrs addrs;				/* the server's addresses */
+	dns_dialer dial;				/* ... being raced; server.fd is its epfd */
+	int server_port;
+	upstream_conn *upstream;		/* the server connection once open */
+	int server_keep_alive;			/* ... and whether it can be pooled */
+	int fresh;						/* don't take one from the pool */
+	int waiting;					/* another thread will post it back */
+	int looked;						/* SearchNodeAsync asked, c->hit set */
+	cache_fill *fill;				/* fetch of uri claimed or tailed */
+	int filling;					/* claimed it */
+	int streaming;					/* ... and object is its buffer */
+	int waited;						/* waited for someone else's fetch */
+	char req[EV_REQBUF];			/* request head read from the client */
+	int reqlen;
+	http_request hr;				/* ... parsed as it arrives */
+	int headlen;					/* length of the current request head */
+	int keep_alive;					/* reuse the client connection */
+	int nreqs;						/* requests seen on the connection */
+	char buf[3 * EV_REQBUF];		/* upstream request, then relay buffer */
+	int buflen;
+	char *outp;						/* pending output and its progress */
+	int outlen, outpos;
+	cache_block *hit;				/* cached object being sent or revalidated */
+	int hitpos;
+	cache_range range;				/* ... or the part of it asked for */
+	char *object;					/* body captured for the cache */
+	int objsize, objlen;
+	char *hdrs;						/* ... and its headers, see store_header */
+	int hdrlen;
+	int caching;					/* still capturing the body */
+	int pipefd[2];					/* splice pipe, or -1 until needed */
+	int piped;						/* body bytes waiting in the pipe */
+	http_cache_info ci;				/* what the response says about caching */
+	int content_size;				/* -1 if the server sent none */
+	int chunked;					/* body uses chunked framing */
+	chunk_state chunk;
+	long chunk_left;				/* data left in the chunk, or its size */
+	int trailer_len;				/* length of the current trailer line */
+	int body_read;
+	int eof;						/* server closed its end */
+	conn_list *watch;				/* idle or server list it is on, or NULL */
+	time_t since;					/* ... since when it has waited */
+	struct conn *watch_prev, *watch_next;
+	struct conn *next;				/* graveyard or resolved list link */
+} conn_t;
+
+typedef struct ev_loop {
+	int epfd;
+	int listenfd;
+	time_t paused;					/* out of descriptors since, or 0 */
+	int cpu;						/* CPU to pin to, or -1 */
+	conn_list idle;					/* waiting for a request */
+	conn_list server;				/* waiting on the server */
+	conn_t *graveyard;				/* closed, freed after the batch */
+	ev_side wakeup;					/* eventfd signalled by the resolvers */
+	pthread_mutex_t resolved_lock;
+	conn_t *resolved;				/* lookups completed for this loop */
+} ev_loop;
+
+
+/*
+ * ev_add - register a descriptor for edge-triggered reads and writes
+ */
+static int ev_add(ev_loop *lp, ev_side *side)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = side;
+	return epoll_ctl(lp->epfd, EPOLL_CTL_ADD, side->fd, &ev);
+}
+
+static void set_output(conn_t *c, char *p, int len)
+{
+	c->outp = p;
+	c->outlen = len;
+	c->outpos = 0;
+}
+
+static void unwatch(conn_t *c)
+{
+	conn_list *l = c->watch;
+
+	if (l == NULL)
+		return;
+	c->watch = NULL;
+	if (c->watch_prev)
+		c->watch_prev->watch_next = c->watch_next;
+	else
+		l->head = c->watch_next;
+	if (c->watch_next)
+		c->watch_next->watch_prev = c->watch_prev;
+	else
+		l->tail = c->watch_prev;
+}
+
+/*
+ * watch - start waiting on list l as of now, leaving any list it was on.
+ *         Connections join at the tail, so lists stay ordered by since
+ */
+static void watch(conn_list *l, conn_t *c)
+{
+	unwatch(c);
+	c->watch = l;
+	c->since = time(NULL);
+	c->watch_next = NULL;
+	c->watch_prev = l->tail;
+	if (l->tail)
+		l->tail->watch_next = c;
+	else
+		l->head = c;
+	l->tail = c;
+}
+
+/*
+ * end_fill - let connections waiting on or tailing this one's fetch know
+ *            it is over, with the whole body if complete
+ */
+static void end_fill(conn_t *c, int complete)
+{
+	if (!c->filling)
+		return;
+	cache_fill_end(c->fill, complete);
+	if (c->streaming) {
+		c->object = NULL;		// went with the fill
+		c->objsize = 0;
+	}
+	c->fill = NULL;
+	c->filling = c->streaming = 0;
+}
+
+/*
+ * drop_fill - give up the fetch the connection claimed or was tailing
+ */
+static void drop_fill(conn_t *c)
+{
+	end_fill(c, 0);
+	if (c->fill)
+		ReleaseFill(c->fill);
+	c->fill = NULL;
+}
+
+/*
+ * release_server - done with the server connection: back to the pool if
+ *                  reuse is set and nothing of the response is left on it,
+ *                  otherwise closed
+ */
+static void release_server(ev_loop *lp, conn_t *c, int reuse)
+{
+	if (c->upstream == NULL)
+		return;
+	if (reuse && c->piped == 0 &&
+		epoll_ctl(lp->epfd, EPOLL_CTL_DEL, c->server.fd, NULL) == 0)
+		upstream_put(c->upstream);
+	else
+		upstream_close(c->upstream);
+	c->upstream = NULL;
+	c->server.fd = -1;
+}
+
+/*
+ * conn_retire - close a connection. Its memory is released only after
+ *               the current batch of events, which may still refer to it
+ */
+static void conn_retire(ev_loop *lp, conn_t *c)
+{
+	unwatch(c);
+	c->state = CONN_DONE;
+	close(c->client.fd);
+	if (c->dial.epfd >= 0) {		// still connecting
+		dns_dial_end(&c->dial);
+		c->server.fd = -1;
+	}
+	release_server(lp, c, 0);
+	if (c->pipefd[0] >= 0) {
+		close(c->pipefd[0]);
+		close(c->pipefd[1]);
+	}
+	c->next = lp->graveyard;
+	lp->graveyard = c;
+	end_fill(c, 0);
+}
+
+static void conn_free(conn_t *c)
+{
+	if (c->hit)
+		ReleaseNode(c->hit);
+	cache_range_free(&c->range);
+	drop_fill(c);
+	free(c->object);
+	free(c->hdrs);
+	free(c->uri);
+	free(c);
+}
+
+/*
+ * conn_reset - clear per-request state, ready for a request that may
+ *              already be partly buffered behind the previous one
+ */
+static void conn_reset(conn_t *c)
+{
+	if (c->hit)
+		ReleaseNode(c->hit);
+	c->hit = NULL;
+	cache_range_free(&c->range);
+	drop_fill(c);
+	c->looked = c->waited = 0;
+	free(c->object);
+	free(c->hdrs);
+	free(c->uri);
+	c->object = c->hdrs = c->uri = NULL;
+	c->objsize = c->objlen = c->buflen = c->body_read = c->eof = 0;
+	c->server_keep_alive = c->fresh = 0;
+	c->caching = 1;
+	c->content_size = -1;
+	c->chunked = 0;
+	c->chunk = CHUNK_SIZE;
+	c->chunk_left = 0;
+	set_output(c, c->buf, 0);
+	c->reqlen -= c->headlen;
+	memmove(c->req, c->req + c->headlen, c->reqlen);
+	c->headlen = 0;
+	http_request_init(&c->hr);
+}
+
+/*
+ * flush_output - write pending output to fd
+ * Returns 1 when everything is written, 0 on EAGAIN and -1 on error
+ */
+static int flush_output(conn_t *c, int fd)
+{
+	ssize_t n;
+
+	while (c->outpos < c->outlen) {
+		if ((n = write(fd, c->outp + c->outpos, c->outlen - c->outpos)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		c->outpos += n;
+	}
+	return 1;
+}
+
+/*
+ * flush_pipe - splice the body bytes waiting in the pipe to the client
+ * Returns 1 when the pipe is empty, 0 on EAGAIN and -1 on error
+ */
+static int flush_pipe(conn_t *c)
+{
+	ssize_t n;
+
+	while (c->piped > 0) {
+		if ((n = splice(c->pipefd[0], NULL, c->client.fd, NULL, c->piped,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		c->piped -= n;
+	}
+	return 1;
+}
+
+/*
+ * respond_error - replace whatever the connection was doing with an error
+ *                 response to the client
+ */
+static int respond_error(conn_t *c, char *cause, char *errnum,
+						char *shortmsg, char *longmsg)
+{
+	if (c->hit)					// the stale copy being revalidated
+		ReleaseNode(c->hit);
+	c->hit = NULL;
+	c->server_keep_alive = 0;	// whatever is left of its response
+	set_output(c, c->buf,
+			format_clienterror(c->buf, cause, errnum, shortmsg, longmsg));
+	c->keep_alive = 0;
+	c->state = CONN_WRITE_CLIENT;
+	return STEP_NEXT;
+}
+
+/*
+ * next_line - return the length of the line at p, including its newline
+ */
+static int next_line(char *p)
+{
+	char *nl = strchr(p, '\n');
+
+	return nl ? nl - p + 1 : strlen(p);
+}
+
+/*
+ * serve_hit - answer the request from the cache, headers and body both
+ *             sent from the cache segment, or just the range asked for
+ */
+static int serve_hit(conn_t *c, cache_block *hit)
+{
+	c->hit = hit;
+	c->hitpos = 0;
+	cache_range_init(&c->range, hit, &c->hr, c->keep_alive);
+	set_output(c, c->buf, 0);
+	c->caching = 0;
+	c->state = CONN_WRITE_CLIENT;
+	return STEP_NEXT;
+}
+
+/*
+ * serve_fill - answer the request from another connection's fetch of the
+ *              object, tailing its body as it arrives
+ */
+static int serve_fill(conn_t *c)
+{
+	c->hitpos = 0;
+	set_output(c, c->buf, 0);
+	c->caching = 0;
+	c->state = CONN_WRITE_CLIENT;
+	return STEP_NEXT;
+}
+
+/*
+ * conn_wake - called on a resolver thread once c->addrs is filled in, on
+ *             a disk reader once c->hit is, or on the thread filling the
+ *             object c waits for: hand the connection back to its loop
+ */
+static void conn_wake(void *arg)
+{
+	conn_t *c = arg;
+	ev_loop *lp = c->loop;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&lp->resolved_lock);
+	c->next = lp->resolved;
+	lp->resolved = c;
+	pthread_mutex_unlock(&lp->resolved_lock);
+	if (write(lp->wakeup.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		unix_error("eventfd write error");
+}
+
+/*
+ * start_request - act on a complete request head
+ */
+static int start_request(ev_loop *lp, conn_t *c)
+{
+	http_request *r = &c->hr;
+	char cause[MAXLINE];
+
+	unwatch(c);
+	c->headlen = r->pos;
+	if (!http_slice_is(r->method, "GET")) {
+		snprintf(cause, sizeof(cause), "%.*s", r->method.len, r->method.p);
+		return respond_error(c, cause, "501", "Not Implemented",
+							"Proxy does not implement this method");
+	}
+	if (http_parse_uri(r) < 0) {
+		snprintf(cause, sizeof(cause), "%.*s", r->uri.len, r->uri.p);
+		return respond_error(c, cause, "400", "Bad Request",
+							"Proxy could not parse the request URI");
+	}
+
+	c->keep_alive = http_keep_alive(r) && ++c->nreqs < max_requests;
+	c->uri = Malloc(r->uri.len + 1);		// the key is never longer
+	http_cache_key(r, c->uri, r->uri.len + 1);
+	c->state = CONN_LOOKUP;
+	return STEP_NEXT;
+}
+
+/*
+ * start_fetch - send the request to the server, on an idle pooled
+ *               connection if there is one, otherwise on a new one once
+ *               the server's name is resolved
+ */
+static int start_fetch(ev_loop *lp, conn_t *c)
+{
+	http_request *r = &c->hr;
+	char server_hostname[MAXLINE];
+	int fd;
+
+	c->buflen = format_request(c->buf, r, upstream_enabled(),
+							c->hit ? c->hit->etag : NULL,
+							c->hit ? c->hit->modified : NULL);
+	set_output(c, c->buf, c->buflen);
+
+	snprintf(server_hostname, sizeof(server_hostname), "%.*s", r->host.len,
+			r->host.p);
+	c->server_port = r->port;
+	if (!c->fresh &&
+		(c->upstream = upstream_take(server_hostname, r->port)) != NULL) {
+		c->server.fd = fd = c->upstream->fd;
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0 &&
+			ev_add(lp, &c->server) == 0) {
+			c->state = CONN_SEND_REQUEST;
+			return STEP_NEXT;
+		}
+		release_server(lp, c, 0);
+	}
+	c->state = CONN_RESOLVE;
+	if (dns_lookup_async(server_hostname, &c->addrs, conn_wake, c) == DNS_PENDING) {
+		c->waiting = 1;
+		return STEP_AGAIN;
+	}
+	return STEP_NEXT;
+}
+
+/*
+ * step_lookup - serve the request from the cache, or else go to the
+ *               server, unless another connection is already fetching
+ *               the object
+ */
+static int step_lookup(ev_loop *lp, conn_t *c)
+{
+	http_request *r = &c->hr;
+
+	if (c->waiting)
+		return STEP_AGAIN;
+	if (!c->looked) {
+		c->looked = 1;
+		if (SearchNodeAsync(c->uri, r, c->waited, &c->hit, conn_wake, c)
+			== CACHE_PENDING) {
+			c->waiting = 1;				// being read back from disk
+			return STEP_AGAIN;
+		}
+	}
+	if (c->hit != NULL && FreshNode(c->hit))		// Cache hit
+		return serve_hit(c, c->hit);
+	if (c->hit != NULL)
+		;							// stale: revalidate it with the server
+	else if (passes_range(r))
+		;							// the server answers the range itself
+	else if (!c->waited) {
+		c->waited = 1;
+		switch (cache_claim(c->uri, r, &c->fill, conn_wake, c)) {
+		case CACHE_FETCH:
+			c->filling = 1;
+			break;
+		case CACHE_STREAM:
+			return serve_fill(c);
+		case CACHE_PENDING:
+			c->looked = 0;				// look again once it is over
+			c->waiting = 1;
+			return STEP_AGAIN;
+		}
+	}
+	else if (cache_attach(c->uri, r, &c->fill))
+		return serve_fill(c);
+	return start_fetch(lp, c);
+}
+
+static int step_read_request(ev_loop *lp, conn_t *c)
+{
+	ssize_t n;
+
+	for (;;) {
+		switch (http_parse_request(&c->hr, c->req, c->reqlen)) {
+		case HTTP_DONE:
+			return start_request(lp, c);
+		case HTTP_ERROR:
+			unwatch(c);
+			return respond_error(c, "request", "400", "Bad Request",
+								"Proxy could not parse the request");
+		}
+		if (c->reqlen == EV_REQBUF) {
+			unwatch(c);
+			return respond_error(c, "request", "400", "Bad Request",
+								"Request header too long");
+		}
+		n = read(c->client.fd, c->req + c->reqlen, EV_REQBUF - c->reqlen);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return STEP_AGAIN;
+		}
+		if (n <= 0) {
+			c->state = CONN_DONE;
+			return STEP_NEXT;
+		}
+		c->reqlen += n;
+	}
+}
+
+/*
+ * step_resolve - start dialing once the server's addresses are known. The
+ *                dial's own epoll descriptor stands in for the server
+ *                until one of its attempts connects
+ */
+static int step_resolve(ev_loop *lp, conn_t *c)
+{
+	if (c->waiting)
+		return STEP_AGAIN;
+	if ((c->server.fd = dns_dial_start(&c->dial, &c->addrs,
+										c->server_port)) < 0 ||
+		ev_add(lp, &c->server) < 0) {
+		dns_dial_end(&c->dial);
+		c->server.fd = -1;
+		return respond_error(c, c->uri, "502", "Bad Gateway",
+							"Proxy could not connect to the server");
+	}
+	c->state = CONN_CONNECT;
+	return STEP_NEXT;
+}
+
+/*
+ * step_connect - move the dial on, and once it has connected put the
+ *                winning socket in its place
+ */
+static int step_connect(ev_loop *lp, conn_t *c)
+{
+	char server_hostname[MAXLINE];
+	int fd;
+
+	if ((fd = dns_dial_poll(&c->dial)) == DNS_DIAL_AGAIN)
+		return STEP_AGAIN;
+	dns_dial_end(&c->dial);
+	if ((c->server.fd = fd) >= 0) {
+		snprintf(server_hostname, sizeof(server_hostname), "%.*s",
+				c->hr.host.len, c->hr.host.p);
+		c->upstream = upstream_new(server_hostname, c->server_port, fd);
+	}
+	if (fd < 0 || ev_add(lp, &c->server) < 0)
+		return respond_error(c, c->uri, "502", "Bad Gateway",
+							"Proxy could not connect to the server");
+	c->state = CONN_SEND_REQUEST;
+	return STEP_NEXT;
+}
+
+/*
+ * retry_fetch - the server closed a pooled connection before answering,
+ *               as it may do to an idle one at any time: send the request
+ *               again on a new connection
+ */
+static int retry_fetch(ev_loop *lp, conn_t *c)
+{
+	release_server(lp, c, 0);
+	c->fresh = 1;
+	return start_fetch(lp, c);
+}
+
+static int step_send_request(ev_loop *lp, conn_t *c)
+{
+	switch (flush_output(c, c->server.fd)) {
+	case 0:
+		return STEP_AGAIN;
+	case 1:
+		c->buflen = 0;
+		set_output(c, c->buf, 0);
+		c->state = CONN_RELAY_HEADERS;
+		return STEP_NEXT;
+	default:
+		if (c->upstream->reused)
+			return retry_fetch(lp, c);
+		return respond_error(c, c->uri, "502", "Bad Gateway",
+							"Proxy could not send the request");
+	}
+}
+
+/*
+ * capture - keep a copy of n body bytes at p for the cache while it fits,
+ *           see copy_body
+ */
+static void capture(conn_t *c, char *p, int n)
+{
+	if (!c->caching)
+		return;
+	if (!copy_body(&c->object, &c->objsize, &c->objlen,
+				c->chunked ? -1 : c->content_size, p, n)) {
+		c->caching = 0;
+		return;
+	}
+	if (c->streaming)
+		cache_fill_grow(c->fill, c->objlen);
+}
+
+/*
+ * scan_chunks - follow the chunk framing through n bytes at p, capturing
+ *               the chunk data. A malformed body is relayed on until the
+ *               server closes, uncached
+ * Returns how many of them belong to the body
+ */
+static int scan_chunks(conn_t *c, char *p, int n)
+{
+	int i = 0, k;
+	char ch;
+
+	while (i < n && c->chunk != CHUNK_DONE) {
+		if (c->chunk == CHUNK_DATA) {
+			k = c->chunk_left < n - i ? c->chunk_left : n - i;
+			capture(c, p + i, k);
+			i += k;
+			if ((c->chunk_left -= k) == 0)
+				c->chunk = CHUNK_DATA_END;
+			continue;
+		}
+		ch = p[i++];
+		switch (c->chunk) {
+		case CHUNK_SIZE:
+			if (isxdigit((unsigned char)ch) && c->chunk_left < LONG_MAX / 16) {
+				c->chunk_left = c->chunk_left * 16 +
+					(isdigit((unsigned char)ch) ? ch - '0' :
+					tolower((unsigned char)ch) - 'a' + 10);
+				break;
+			}
+			else if (ch == ';' || ch == ' ' || ch == '\t') {
+				c->chunk = CHUNK_EXT;
+				break;
+			}
+			else if (ch == '\r')
+				break;
+			else if (ch == '\n')
+				goto size_line_end;
+			c->chunked = 0;			// malformed or absurd size
+			c->caching = c->keep_alive = 0;
+			return n;
+		case CHUNK_EXT:
+			if (ch != '\n')
+				break;
+size_line_end:
+			c->chunk = c->chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+			c->trailer_len = 0;
+			break;
+		case CHUNK_DATA_END:
+			if (ch == '\n') {
+				c->chunk = CHUNK_SIZE;
+				c->chunk_left = 0;
+			}
+			break;
+		case CHUNK_TRAILER:
+			if (ch == '\n') {
+				if (c->trailer_len == 0)
+					c->chunk = CHUNK_DONE;
+				c->trailer_len = 0;
+			}
+			else if (ch != '\r')
+				c->trailer_len++;
+			break;
+		default:
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * capture_body - account for n body bytes at p, keeping a copy for the
+ *                cache while it fits
+ * Returns how many of them belong to the body; anything the server sent
+ * past its end is dropped
+ */
+static int capture_body(conn_t *c, char *p, int n)
+{
+	int len = n;
+
+	if (c->chunked)
+		len = scan_chunks(c, p, n);
+	else {
+		if (c->content_size >= 0 && c->body_read + n > c->content_size)
+			len = c->content_size - c->body_read;
+		capture(c, p, len);
+	}
+	if (len < n)				// the connection is out of step, don't pool it
+		c->server_keep_alive = 0;
+	c->body_read += len;
+	return len;
+}
+
+/*
+ * body_done - whether the whole body has been read from the server
+ */
+static int body_done(conn_t *c)
+{
+	if (c->chunked)
+		return c->chunk == CHUNK_DONE;
+	return c->eof || (c->content_size >= 0 &&
+					c->body_read >= c->content_size);
+}
+
+/*
+ * parse_framing - work out how the body is delimited, and what the
+ *                 response says about caching, from the response headers
+ *                 held in the NUL-terminated string hdrs. Those to cache
+ *                 with the body are copied to c->hdrs
+ */
+static void parse_framing(conn_t *c, char *hdrs)
+{
+	char *p, save;
+	int len;
+
+	http_cache_init(&c->ci, hdrs);
+	c->server_keep_alive = !strncasecmp(hdrs, "HTTP/1.1", 8);
+	if (c->caching && c->hdrs == NULL)
+		c->hdrs = Malloc(MAXBUF);
+	c->hdrlen = 0;
+	for (p = hdrs; (len = next_line(p)) > 0; p += len) {
+		save = p[len];
+		p[len] = '\0';
+		if (!strncasecmp(p, "Content-length:", 15))
+			c->content_size = atoi(p + 15);
+		else if (is_chunked(p))
+			c->chunked = 1;
+		http_cache_line(&c->ci, p);
+		update_keep_alive(p, &c->server_keep_alive);
+		if (c->hdrs && strcmp(p, "\r\n"))
+			store_header(c->hdrs, &c->hdrlen, p);
+		p[len] = save;
+	}
+	if (c->chunked)				// chunked framing overrides Content-length
+		c->content_size = -1;
+	if (!body_allowed(hdrs)) {
+		c->content_size = 0;
+		c->chunked = 0;
+	}
+	if (c->content_size < 0 && !c->chunked)	// only EOF ends the body
+		c->server_keep_alive = 0;
+}
+
+/*
+ * rewrite_headers - replace the server's connection headers in the hdrlen
+ *                   bytes of headers at the start of c->buf with one for
+ *                   the client connection, moving the body bytes behind
+ *                   them. Returns the new header length
+ */
+static int rewrite_headers(conn_t *c, int hdrlen)
+{
+	char hdrs[MAXBUF + MAXLINE], *p, save;
+	int len, n = 0;
+
+	c->buf[hdrlen - 2] = '\0';		// drop the blank line
+	for (p = c->buf; (len = next_line(p)) > 0; p += len) {
+		save = p[len];
+		p[len] = '\0';
+		if (!is_hop_header(p)) {
+			memcpy(hdrs + n, p, len);
+			n += len;
+		}
+		p[len] = save;
+	}
+	n += sprintf(hdrs + n, "Connection: %s\r\n\r\n",
+				c->keep_alive ? "keep-alive" : "close");
+
+	memmove(c->buf + n, c->buf + hdrlen, c->buflen - hdrlen);
+	memcpy(c->buf, hdrs, n);
+	c->buflen += n - hdrlen;
+	return n;
+}
+
+/*
+ * step_relay_headers - buffer the response until its headers are complete
+ */
+static int step_relay_headers(ev_loop *lp, conn_t *c)
+{
+	ssize_t n;
+	char *end, save;
+	int hdrlen;
+
+	for (;;) {
+		n = read(c->server.fd, c->buf + c->buflen, MAXBUF - c->buflen);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return STEP_AGAIN;
+		}
+		if (n <= 0 && c->buflen == 0 && c->upstream->reused)
+			return retry_fetch(lp, c);
+		if (n <= 0)			// closed before the headers were through
+			return respond_error(c, c->uri, "502", "Bad Gateway",
+						"Proxy could not get a response from the server");
+		c->buflen += n;
+		if ((end = memmem(c->buf, c->buflen, "\r\n\r\n", 4)) != NULL) {
+			hdrlen = end + 4 - c->buf;
+			save = c->buf[hdrlen];
+			c->buf[hdrlen] = '\0';
+			parse_framing(c, c->buf);
+			c->buf[hdrlen] = save;
+			if (c->hit && c->ci.status == 304) {	// still good
+				if (c->buflen > hdrlen)
+					c->server_keep_alive = 0;
+				return serve_hit(c, refresh_response(c->hit, c->hdrs,
+									c->hdrs ? c->hdrlen : -1, &c->ci));
+			}
+			if (c->hit) {			// replaced by the response
+				if (c->ci.no_store)
+					DropNode(c->hit);
+				ReleaseNode(c->hit);
+			}
+			c->hit = NULL;
+			if (c->content_size < 0 && !c->chunked)	// only EOF ends the body
+				c->keep_alive = 0;
+			if (c->content_size > max_object_size ||
+				!http_cacheable(&c->ci) || c->hdrlen < 0)
+				c->caching = 0;
+			// With its length known up front, the body is captured where
+			// connections missing on the URL meanwhile can tail it
+			if (c->caching && c->filling && !c->chunked &&
+				c->content_size > 0) {
+				c->object = cache_fill_start(c->fill, &c->hr, c->ci.vary,
+									c->hdrs, c->hdrlen, c->content_size);
+				c->objsize = c->content_size;
+				c->streaming = 1;
+			}
+			hdrlen = rewrite_headers(c, hdrlen);
+			c->buflen = hdrlen +
+				capture_body(c, c->buf + hdrlen, c->buflen - hdrlen);
+			break;
+		}
+		if (c->buflen == MAXBUF) {	// oversized headers, relay uncached
+			c->caching = c->keep_alive = c->server_keep_alive = 0;
+			break;
+		}
+	}
+	if (!c->caching)				// nobody need wait for it
+		end_fill(c, 0);
+	set_output(c, c->buf, c->buflen);
+	c->state = CONN_RELAY_BODY;
+	return STEP_NEXT;
+}
+
+/*
+ * finish_response - the response is out: pool the server connection if
+ *                   it was read to the end of the response, then wait for
+ *                   the next request on a persistent connection, or close
+ *                   it
+ */
+static int finish_response(ev_loop *lp, conn_t *c)
+{
+	release_server(lp, c, c->server_keep_alive && !c->eof && body_done(c));
+	if (!c->keep_alive) {
+		c->state = CONN_DONE;
+		return STEP_NEXT;
+	}
+	conn_reset(c);
+	c->state = CONN_READ_REQUEST;
+	watch(&lp->idle, c);
+	return STEP_NEXT;
+}
+
+/*
+ * step_relay_body - copy the rest of the response to the client. The
+ *                   server is only read once the client has taken the
+ *                   previous buffer, which bounds memory per connection.
+ *                   Once the body is no longer being cached it is spliced
+ *                   through the pipe instead
+ */
+static int step_relay_body(ev_loop *lp, conn_t *c)
+{
+	ssize_t n;
+	int r, len;
+
+	for (;;) {
+		if ((r = flush_output(c, c->client.fd)) > 0)
+			r = flush_pipe(c);
+		if (r <= 0) {
+			if (r == 0)
+				return STEP_AGAIN;
+			c->state = CONN_DONE;
+			return STEP_NEXT;
+		}
+		if (body_done(c) || c->eof)
+			break;
+		// Chunk framing has to be followed, so chunked bodies stay buffered
+		if (!c->caching && !c->chunked && c->pipefd[0] < 0 &&
+			pipe2(c->pipefd, O_NONBLOCK) < 0)
+			c->pipefd[0] = -1;		// stay on the buffered path
+		if (!c->caching && !c->chunked && c->pipefd[0] >= 0) {
+			len = EV_SPLICE_LEN;
+			if (c->content_size >= 0 && c->content_size - c->body_read < len)
+				len = c->content_size - c->body_read;
+			n = splice(c->server.fd, NULL, c->pipefd[1], NULL, len,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0) {
+				c->piped = n;
+				c->body_read += n;
+				continue;
+			}
+		}
+		else if ((n = read(c->server.fd, c->buf, MAXBUF)) > 0) {
+			set_output(c, c->buf, capture_body(c, c->buf, n));
+			continue;
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return STEP_AGAIN;
+			c->caching = 0;		// reset by the server, don't cache
+		}
+		if (n <= 0) {
+			c->eof = 1;
+			if (c->content_size >= 0 || c->chunked)
+				c->caching = c->keep_alive = 0;	// truncated
+		}
+	}
+
+	if (c->caching && body_done(c))
+		store_response(c->uri, &c->hr, c->object, c->objlen, c->hdrs,
+					c->hdrlen, &c->ci);
+	end_fill(c, c->caching && body_done(c));
+	return finish_response(lp, c);
+}
+
+static int step_write_client(ev_loop *lp, conn_t *c)
+{
+	int r;
+
+	if (c->waiting)
+		return STEP_AGAIN;
+	if ((r = flush_output(c, c->client.fd)) > 0) {
+		if (c->hit && c->range.nparts)
+			r = SendRange(c->client.fd, c->hit, &c->range, &c->hitpos);
+		else if (c->hit)
+			r = SendData(c->client.fd, c->hit, c->keep_alive, &c->hitpos);
+		else if (c->fill && !c->filling)
+			r = TailData(c->client.fd, c->fill, c->keep_alive, &c->hitpos,
+						conn_wake, c);
+	}
+	switch (r) {
+	case CACHE_PENDING:
+		c->waiting = 1;
+		return STEP_AGAIN;
+	case 0:
+		return STEP_AGAIN;
+	case 1:
+		return finish_response(lp, c);
+	default:
+		c->state = CONN_DONE;
+		return STEP_NEXT;
+	}
+}
+
+/*
+ * conn_drive - run the state machine until it blocks or finishes. Blocked
+ *              on the server, or on the client in the middle of relaying
+ *              the response, the connection has just made progress, so its
+ *              server deadline starts over
+ */
+static void conn_drive(ev_loop *lp, conn_t *c)
+{
+	int r = STEP_NEXT;
+
+	while (r == STEP_NEXT) {
+		switch (c->state) {
+		case CONN_READ_REQUEST:	r = step_read_request(lp, c);	break;
+		case CONN_LOOKUP:		r = step_lookup(lp, c);			break;
+		case CONN_RESOLVE:		r = step_resolve(lp, c);		break;
+		case CONN_CONNECT:		r = step_connect(lp, c);		break;
+		case CONN_SEND_REQUEST:	r = step_send_request(lp, c);	break;
+		case CONN_RELAY_HEADERS:r = step_relay_headers(lp, c);	break;
+		case CONN_RELAY_BODY:	r = step_relay_body(lp, c);		break;
+		case CONN_WRITE_CLIENT:	r = step_write_client(lp, c);	break;
+		case CONN_DONE:
+			conn_retire(lp, c);
+			return;
+		}
+	}
+	if (c->state == CONN_SEND_REQUEST || c->state == CONN_RELAY_HEADERS ||
+		c->state == CONN_RELAY_BODY)
+		watch(&lp->server, c);
+	else if (c->watch == &lp->server)
+		unwatch(c);
+}
+
+/*
+ * server_expire - give up on a server that has gone silent: answer 504 if
+ *                 the response has not begun, otherwise close the
+ *                 connection. Either way the fetch ends, and connections
+ *                 tailing it with it
+ */
+static void server_expire(ev_loop *lp, conn_t *c)
+{
+	unwatch(c);
+	if (c->state == CONN_RELAY_BODY) {
+		conn_retire(lp, c);
+		return;
+	}
+	release_server(lp, c, 0);
+	end_fill(c, 0);
+	respond_error(c, c->uri, "504", "Gateway Timeout",
+				"Proxy timed out waiting for the server");
+	conn_drive(lp, c);
+}
+
+/*
+ * listen_add - watch the listening socket for connections, on this loop
+ *              alone if it is shared (EPOLLEXCLUSIVE)
+ */
+static int listen_add(ev_loop *lp)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+	ev.events |= EPOLLEXCLUSIVE;
+#endif
+	ev.data.ptr = NULL;
+	return epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->listenfd, &ev);
+}
+
+/*
+ * accept_clients - accept pending connections onto this loop. Out of
+ *                  descriptors, the level-triggered listening socket
+ *                  would wake the loop at once again and again, so it is
+ *                  taken off the loop until a connection closes, or a
+ *                  second has passed
+ */
+static void accept_clients(ev_loop *lp)
+{
+	conn_t *c;
+	int fd;
+
+	while ((fd = accept4(lp->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0
+			|| errno == EINTR || errno == EMFILE || errno == ENFILE) {
+		if (fd < 0 && errno != EINTR) {
+			epoll_ctl(lp->epfd, EPOLL_CTL_DEL, lp->listenfd, NULL);
+			lp->paused = time(NULL);
+			return;
+		}
+		if (fd < 0)
+			continue;
+		c = Calloc(1, sizeof(conn_t));
+		c->state = CONN_READ_REQUEST;
+		c->loop = lp;
+		c->client.conn = c;
+		c->client.fd = fd;
+		c->server.conn = c;
+		c->server.fd = -1;
+		c->dial.epfd = -1;
+		c->pipefd[0] = c->pipefd[1] = -1;
+		c->content_size = -1;
+		c->caching = 1;
+		c->chunk = CHUNK_SIZE;
+		http_request_init(&c->hr);
+		watch(&lp->idle, c);
+		if (ev_add(lp, &c->client) < 0)
+			conn_retire(lp, c);
+	}
+}
+
+/*
+ * resume_resolved - drive the connections whose lookups have completed.
+ *                   Those closed in the meantime were left for us to free
+ */
+static void resume_resolved(ev_loop *lp)
+{
+	conn_t *c, *next;
+	uint64_t count;
+
+	if (read(lp->wakeup.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		unix_error("eventfd read error");
+	pthread_mutex_lock(&lp->resolved_lock);
+	c = lp->resolved;
+	lp->resolved = NULL;
+	pthread_mutex_unlock(&lp->resolved_lock);
+	for (; c; c = next) {
+		next = c->next;
+		c->waiting = 0;
+		if (c->state == CONN_DONE)
+			conn_free(c);
+		else
+			conn_drive(lp, c);
+	}
+}
+
+static void *event_loop(void *vargp)
+{
+	ev_loop *lp = vargp;
+	struct epoll_event events[EV_MAX_EVENTS];
+	ev_side *side;
+	conn_t *c;
+	int i, n, closed;
+	time_t now;
+
+	if (lp->cpu >= 0)
+		pin_thread(lp->cpu);
+	while (1) {
+		// Wake up every second to sweep idle connections and silent
+		// servers, or to try accepting again
+		if ((n = epoll_wait(lp->epfd, events, EV_MAX_EVENTS,
+							idle_timeout > 0 || server_timeout > 0 ||
+							lp->paused ? 1000 : -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			unix_error("epoll_wait error");
+		}
+		for (i = 0; i < n; i++) {
+			if ((side = events[i].data.ptr) == NULL) {
+				accept_clients(lp);
+				continue;
+			}
+			if ((c = side->conn) == NULL) {
+				resume_resolved(lp);
+				continue;
+			}
+			if (c->state == CONN_DONE)	// closed earlier in this batch
+				continue;
+			conn_drive(lp, c);
+		}
+		now = time(NULL);
+		while (idle_timeout > 0 && (c = lp->idle.head) != NULL &&
+				now - c->since >= idle_timeout)
+			conn_retire(lp, c);
+		while (server_timeout > 0 && (c = lp->server.head) != NULL &&
+				now - c->since >= server_timeout)
+			server_expire(lp, c);
+		for (closed = 0; (c = lp->graveyard) != NULL; closed = 1) {
+			lp->graveyard = c->next;
+			if (!c->waiting)		// else freed once it is posted back
+				conn_free(c);
+		}
+		if (lp->paused && (closed || now > lp->paused)) {
+			lp->paused = 0;
+			if (listen_add(lp) < 0)
+				unix_error("epoll_ctl error");
+		}
+	}
+	return NULL;
+}
+
+/*
+ * event_run - serve clients on nloops epoll loops, one per thread. Loops
+ *             may share a listening socket, in which case EPOLLEXCLUSIVE
+ *             wakes only one of them per incoming connection
+ */
+void event_run(int *listenfds, int nloops, int pin)
+{
+	ev_loop *loops = Calloc(nloops, sizeof(ev_loop));
+	struct epoll_event ev;
+	pthread_t tid;
+	int i, fd;
+
+	for (i = 0; i < nloops; i++) {
+		fd = listenfds[i];
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+			unix_error("fcntl error");
+		if ((loops[i].epfd = epoll_create1(0)) < 0)
+			unix_error("epoll_create1 error");
+		loops[i].listenfd = fd;
+		loops[i].cpu = pin ? i : -1;
+		if (listen_add(&loops[i]) < 0)
+			unix_error("epoll_ctl error");
+
+		if ((loops[i].wakeup.fd = eventfd(0, EFD_NONBLOCK)) < 0)
+			unix_error("eventfd error");
+		ev.events = EPOLLIN;
+		ev.data.ptr = &loops[i].wakeup;
+		if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wakeup.fd, &ev) < 0)
+			unix_error("epoll_ctl error");
+		pthread_mutex_init(&loops[i].resolved_lock, NULL);
+	}
+
+	for (i = 1; i < nloops; i++)
+		Pthread_create(&tid, NULL, event_loop, &loops[i]);
+	event_loop(&loops[0]);
+}
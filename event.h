@@ -0,0 +1,13 @@
+/*
+ * event.h - edge-triggered epoll engine
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+/*
+ * Serve connections on nloops epoll loops, loop i accepting from
+ * listenfds[i]; never returns
+ */
+void event_run(int *listenfds, int nloops, int pin);
+
+#endif /* __EVENT_H__ */
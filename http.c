@@ -0,0 +1,755 @@
+/*
+ * http.c - incremental HTTP request parser
+ *
+ * http_parse_request scans each byte of a request head exactly once and
+ * copies nothing: the request line and headers come back as slices of the
+ * caller's buffer. It can be called again as more bytes arrive, resuming
+ * where it stopped, so a request split across reads is never rescanned.
+ * The buffer may grow between calls but must not move.
+ *
+ * http_cache_key turns a parsed request's URI into the key the cache
+ * files it under, in a canonical form so that different spellings of one
+ * URI share an entry, and hashes it once for every lookup to use.
+ *
+ * http_ranges works out which parts of a cached object a Range request
+ * is to get.
+ *
+ * The http_cache functions go through a response's header lines for what
+ * they say about caching it, and work out how long it stays fresh.
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+
+/* Freshness when the response gives none, see http_expires */
+#define HTTP_HEURISTIC_TTL	300		/* seconds, without Last-Modified */
+#define HTTP_HEURISTIC_MAX	86400	/* cap on 10% of the time since then */
+
+/* Query rewriting for cache keys, see http_key_rules */
+static int key_sort;
+static char **key_strip;
+static int nkey_strip;
+
+/* Parser states */
+enum {
+	S_METHOD, S_URI_START, S_URI, S_VERSION_START, S_VERSION, S_LINE_LF,
+	S_HEADER_START, S_NAME, S_VALUE_START, S_VALUE, S_HEADER_LF, S_END_LF
+};
+
+void http_request_init(http_request *r)
+{
+	r->state = S_METHOD;
+	r->pos = r->mark = 0;
+	r->nheaders = 0;
+	r->port = 0;
+}
+
+/*
+ * end_value - close the header value that began at r->mark and ends
+ *             before end, less trailing whitespace
+ */
+static void end_value(http_request *r, char *buf, int end)
+{
+	http_header *h = &r->headers[r->nheaders++];
+
+	while (end > r->mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+		end--;
+	h->value.p = buf + r->mark;
+	h->value.len = end - r->mark;
+}
+
+/*
+ * http_parse_request - scan buf[r->pos..len) for the rest of the request
+ *                      head
+ * Returns HTTP_DONE once the blank line ending it is seen, leaving its
+ * length in r->pos, HTTP_AGAIN if more bytes are needed, and HTTP_ERROR if
+ * it is malformed or has over HTTP_MAX_HEADERS headers
+ */
+int http_parse_request(http_request *r, char *buf, int len)
+{
+	int i;
+	char c;
+
+	for (i = r->pos; i < len; i++) {
+		c = buf[i];
+		switch (r->state) {
+		case S_METHOD:
+			if (c == ' ') {
+				if (i == r->mark)
+					return HTTP_ERROR;
+				r->method.p = buf + r->mark;
+				r->method.len = i - r->mark;
+				r->state = S_URI_START;
+			}
+			else if (!isalpha((unsigned char)c))
+				return HTTP_ERROR;
+			break;
+		case S_URI_START:
+			if (c == ' ')
+				break;
+			if (c == '\r' || c == '\n')
+				return HTTP_ERROR;
+			r->mark = i;
+			r->state = S_URI;
+			break;
+		case S_URI:
+			if (c == ' ') {
+				r->uri.p = buf + r->mark;
+				r->uri.len = i - r->mark;
+				r->state = S_VERSION_START;
+			}
+			else if (c == '\r' || c == '\n')
+				return HTTP_ERROR;
+			break;
+		case S_VERSION_START:
+			if (c == ' ')
+				break;
+			if (c == '\r' || c == '\n')
+				return HTTP_ERROR;
+			r->mark = i;
+			r->state = S_VERSION;
+			break;
+		case S_VERSION:
+			if (c == '\r' || c == '\n') {
+				r->version.p = buf + r->mark;
+				r->version.len = i - r->mark;
+				r->state = c == '\r' ? S_LINE_LF : S_HEADER_START;
+			}
+			else if (c == ' ')
+				return HTTP_ERROR;
+			break;
+		case S_LINE_LF:
+		case S_HEADER_LF:
+			if (c != '\n')
+				return HTTP_ERROR;
+			r->state = S_HEADER_START;
+			break;
+		case S_HEADER_START:
+			if (c == '\r') {
+				r->state = S_END_LF;
+				break;
+			}
+			if (c == '\n') {
+				r->pos = i + 1;
+				return HTTP_DONE;
+			}
+			if (c == ' ' || c == '\t' || c == ':' ||
+				r->nheaders == HTTP_MAX_HEADERS)
+				return HTTP_ERROR;		// folded lines are obsolete
+			r->mark = i;
+			r->state = S_NAME;
+			break;
+		case S_NAME:
+			if (c == ':') {
+				r->headers[r->nheaders].name.p = buf + r->mark;
+				r->headers[r->nheaders].name.len = i - r->mark;
+				r->state = S_VALUE_START;
+			}
+			else if (c == '\r' || c == '\n' || c == ' ' || c == '\t')
+				return HTTP_ERROR;
+			break;
+		case S_VALUE_START:
+			if (c == ' ' || c == '\t')
+				break;
+			r->mark = i;
+			r->state = S_VALUE;
+			// fall through
+		case S_VALUE:
+			if (c == '\r' || c == '\n') {
+				end_value(r, buf, i);
+				r->state = c == '\r' ? S_HEADER_LF : S_HEADER_START;
+			}
+			break;
+		case S_END_LF:
+			if (c != '\n')
+				return HTTP_ERROR;
+			r->pos = i + 1;
+			return HTTP_DONE;
+		}
+	}
+	r->pos = len;
+	return HTTP_AGAIN;
+}
+
+/*
+ * http_parse_uri - split an absolute URI such as http://host:port/path
+ *                  into r->host, r->port and r->path
+ * Returns -1 if the URI is not of that form
+ */
+int http_parse_uri(http_request *r)
+{
+	char *p = r->uri.p, *end = r->uri.p + r->uri.len, *host;
+
+	while (p + 3 <= end && memcmp(p, "://", 3))
+		p++;
+	if (p + 3 > end)
+		return -1;
+	host = p += 3;
+	if (p < end && *p == '[') {		// IPv6 literal
+		while (p < end && *p != ']')
+			p++;
+		if (p == end)
+			return -1;
+		r->host.p = host + 1;
+		r->host.len = p++ - host - 1;
+	}
+	else {
+		while (p < end && *p != ':' && *p != '/')
+			p++;
+		r->host.p = host;
+		r->host.len = p - host;
+	}
+	if (r->host.len == 0)
+		return -1;
+
+	r->port = 80;				// default HTTP port
+	if (p < end && *p == ':') {
+		r->port = 0;
+		while (++p < end && isdigit((unsigned char)*p))
+			r->port = r->port * 10 + *p - '0';
+		if (r->port <= 0 || r->port > 65535)
+			return -1;
+	}
+	if (p == end || *p != '/')
+		return -1;
+	r->path.p = p;
+	r->path.len = end - p;
+	return 0;
+}
+
+/*
+ * http_key_rules - have cache keys list query parameters sorted, if sort
+ *                  is set, and without those named in strip, a
+ *                  comma-separated list in which a name ending in '*'
+ *                  stands for any with that prefix. Both are off by
+ *                  default: they are only safe for servers that don't
+ *                  care about the order, or the stripped parameters
+ */
+void http_key_rules(int sort, char *strip)
+{
+	char *name, *save;
+
+	key_sort = sort;
+	if (strip == NULL)
+		return;
+	for (name = strtok_r(strdup(strip), ",", &save); name;
+		name = strtok_r(NULL, ",", &save)) {
+		key_strip = realloc(key_strip, (nkey_strip + 1) * sizeof(char *));
+		key_strip[nkey_strip++] = name;
+	}
+}
+
+/* Where http_cache_key writes, counting what doesn't fit */
+typedef struct {
+	char *buf;
+	int len, size;
+} key_writer;
+
+static void put(key_writer *w, char c)
+{
+	if (w->len < w->size)
+		w->buf[w->len] = c;
+	w->len++;
+}
+
+static void put_string(key_writer *w, const char *s)
+{
+	while (*s)
+		put(w, *s++);
+}
+
+static int hex_value(char c)
+{
+	return isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c)
+											- 'a' + 10;
+}
+
+/*
+ * put_escaped - write len bytes from p with their percent-encoding
+ *               normalized: escaped unreserved characters decoded, and
+ *               the hex digits of the other escapes in upper case
+ */
+static void put_escaped(key_writer *w, const char *p, int len)
+{
+	int i, c;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != '%' || i + 2 >= len || !isxdigit((unsigned char)p[i + 1])
+			|| !isxdigit((unsigned char)p[i + 2])) {
+			put(w, p[i]);
+			continue;
+		}
+		c = hex_value(p[i + 1]) * 16 + hex_value(p[i + 2]);
+		if (isalnum(c) || (c && strchr("-._~", c)))
+			put(w, c);
+		else {
+			put(w, '%');
+			put(w, toupper((unsigned char)p[i + 1]));
+			put(w, toupper((unsigned char)p[i + 2]));
+		}
+		i += 2;
+	}
+}
+
+static int compare_params(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * stripped - whether the key_rules drop a query parameter
+ */
+static int stripped(const char *param)
+{
+	int i, m, n = strcspn(param, "=");
+
+	for (i = 0; i < nkey_strip; i++) {
+		m = strlen(key_strip[i]);
+		if (m > 0 && key_strip[i][m - 1] == '*' ?
+			n >= m - 1 && !strncmp(param, key_strip[i], m - 1) :
+			n == m && !strncmp(param, key_strip[i], n))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * put_query - write the len-byte query at p, '?' included unless it ends
+ *             up empty, with its parameters normalized and rewritten by
+ *             the key_rules. A query too long to rewrite is only
+ *             normalized
+ */
+static void put_query(key_writer *w, const char *p, int len)
+{
+	char tmp[HTTP_MAX_KEY], *params[HTTP_MAX_PARAMS];
+	key_writer t = { tmp, 0, sizeof(tmp) };
+	const char *end = p + len, *amp;
+	int i, n = 0, first = 1;
+
+	for (; (key_sort || nkey_strip) && p <= end; p = amp + 1) {
+		if ((amp = memchr(p, '&', end - p)) == NULL)
+			amp = end;
+		if (amp == p)
+			continue;
+		if (n == HTTP_MAX_PARAMS)
+			break;
+		params[n++] = tmp + t.len;
+		put_escaped(&t, p, amp - p);
+		put(&t, '\0');
+	}
+	if (!key_sort && !nkey_strip) {
+		put(w, '?');
+		put_escaped(w, p, len);
+		return;
+	}
+	if (p <= end || t.len > t.size) {
+		put(w, '?');
+		put_escaped(w, end - len, len);
+		return;
+	}
+	if (key_sort)
+		qsort(params, n, sizeof(char *), compare_params);
+	for (i = 0; i < n; i++)
+		if (!stripped(params[i])) {
+			put(w, first ? '?' : '&');
+			put_string(w, params[i]);
+			first = 0;
+		}
+}
+
+/*
+ * http_cache_key - write the canonical form of r's absolute URI, as
+ *                  parsed by http_parse_uri, into buf as its cache key:
+ *                  scheme and host in lower case, the port only if not
+ *                  80, percent-encoding normalized, no fragment, and the
+ *                  query rewritten by the http_key_rules
+ * Returns the key's length, or -1 if it does not fit in size bytes. Its
+ * 64-bit FNV-1a hash is left in r->hash
+ */
+int http_cache_key(http_request *r, char *buf, int size)
+{
+	key_writer w = { buf, 0, size - 1 };
+	char *p, *end = r->path.p + r->path.len, *q, *frag, port[16];
+	unsigned long h = 14695981039346656037UL;
+	int i, ipv6 = memchr(r->host.p, ':', r->host.len) != NULL;
+
+	for (p = r->uri.p; memcmp(p, "://", 3); p++)
+		put(&w, tolower((unsigned char)*p));
+	put_string(&w, "://");
+	if (ipv6)
+		put(&w, '[');
+	for (i = 0; i < r->host.len; i++)
+		put(&w, tolower((unsigned char)r->host.p[i]));
+	if (ipv6)
+		put(&w, ']');
+	if (r->port != 80) {
+		snprintf(port, sizeof(port), ":%d", r->port);
+		put_string(&w, port);
+	}
+	for (q = r->path.p; q < end && *q != '?' && *q != '#'; q++)
+		;
+	put_escaped(&w, r->path.p, q - r->path.p);
+	if (q < end && *q == '?') {
+		if ((frag = memchr(q, '#', end - q)) == NULL)
+			frag = end;
+		put_query(&w, q + 1, frag - q - 1);
+	}
+	if (w.len > w.size)
+		return -1;
+	buf[w.len] = '\0';
+
+	for (p = buf; *p; p++) {
+		h ^= (unsigned char)*p;
+		h *= 1099511628211UL;
+	}
+	r->hash = h;
+	return w.len;
+}
+
+/*
+ * http_find_header - the first header called name, matched ignoring case
+ */
+http_header *http_find_header(http_request *r, char *name)
+{
+	int i;
+
+	for (i = 0; i < r->nheaders; i++)
+		if (http_slice_is(r->headers[i].name, name))
+			return &r->headers[i];
+	return NULL;
+}
+
+/*
+ * http_keep_alive - whether the client wants a persistent connection,
+ *                   going by its HTTP version unless a Connection or
+ *                   Proxy-Connection header says otherwise
+ */
+int http_keep_alive(http_request *r)
+{
+	int i, keep_alive = http_slice_is(r->version, "HTTP/1.1");
+	http_header *h;
+
+	for (i = 0; i < r->nheaders; i++) {
+		h = &r->headers[i];
+		if (!http_slice_is(h->name, "Connection") &&
+			!http_slice_is(h->name, "Proxy-Connection"))
+			continue;
+		if (http_slice_has(h->value, "close"))
+			keep_alive = 0;
+		else if (http_slice_has(h->value, "keep-alive"))
+			keep_alive = 1;
+	}
+	return keep_alive;
+}
+
+/*
+ * http_slice_is - whether s is str, ignoring case
+ */
+int http_slice_is(http_slice s, char *str)
+{
+	return (int)strlen(str) == s.len && !strncasecmp(s.p, str, s.len);
+}
+
+/*
+ * http_variant - the key telling apart responses that vary on the
+ *                headers named in vary, a comma-separated list: for each,
+ *                ':' and r's values of it joined by commas, or nothing if
+ *                r has none, then a newline
+ * Returns the key's length, or -1 if it does not fit in size bytes
+ */
+int http_variant(http_request *r, const char *vary, char *buf, int size)
+{
+	char name[HTTP_MAX_VARY];
+	const char *end;
+	http_slice v;
+	int i, n = 0, found;
+
+	for (; *(vary += strspn(vary, ", \t")); vary = end) {
+		end = vary + strcspn(vary, ", \t");
+		snprintf(name, sizeof(name), "%.*s", (int)(end - vary), vary);
+		for (i = found = 0; i < r->nheaders; i++) {
+			if (!http_slice_is(r->headers[i].name, name))
+				continue;
+			v = r->headers[i].value;
+			if (n + 1 + v.len >= size)
+				return -1;
+			buf[n++] = found++ ? ',' : ':';
+			memcpy(buf + n, v.p, v.len);
+			n += v.len;
+		}
+		if (n + 1 >= size)
+			return -1;
+		buf[n++] = '\n';
+	}
+	buf[n] = '\0';
+	return n;
+}
+
+/*
+ * http_if_range - whether r's If-Range, if any, still holds for the
+ *                 object with the given validators: an ETag must match
+ *                 strongly, and a date be its Last-Modified exactly
+ */
+static int http_if_range(http_request *r, const char *etag,
+						const char *modified)
+{
+	http_header *h = http_find_header(r, "If-Range");
+	const char *v;
+
+	if (h == NULL)
+		return 1;
+	if (h->value.len >= 2 && !strncmp(h->value.p, "W/", 2))
+		return 0;
+	v = h->value.p[0] == '"' ? etag : modified;
+	return v && (int)strlen(v) == h->value.len &&
+		!memcmp(v, h->value.p, h->value.len);
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+	long x = ((http_range *)a)->first, y = ((http_range *)b)->first;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * http_ranges - the byte ranges r asks for of a size-byte object with the
+ *               given validators, in ascending order and with those that
+ *               overlap or touch merged
+ * Returns how many there are; 0 if r is to get the whole object instead,
+ * having no Range, or one that is malformed or asks for more than
+ * HTTP_MAX_RANGES, or an If-Range that no longer holds; and -1 if none of
+ * them can be satisfied
+ */
+int http_ranges(http_request *r, const char *etag, const char *modified,
+				long size, http_range *ranges)
+{
+	http_header *h = http_find_header(r, "Range");
+	char spec[HTTP_MAX_VARIANT], *p, *end;
+	long first, last;
+	int i, m, n = 0, asked = 0;
+
+	if (h == NULL || h->value.len >= (int)sizeof(spec) ||
+		!http_if_range(r, etag, modified))
+		return 0;
+	snprintf(spec, sizeof(spec), "%.*s", h->value.len, h->value.p);
+	if (strncasecmp(spec, "bytes", 5))
+		return 0;
+	for (p = spec + 5; *p == ' ' || *p == '\t'; p++)
+		;
+	if (*p++ != '=')
+		return 0;
+	for (; *(p += strspn(p, ", \t")); p = end) {
+		if (++asked > HTTP_MAX_RANGES)
+			return 0;
+		if (*p == '-') {				// the last so many bytes
+			if (!isdigit((unsigned char)p[1]))
+				return 0;
+			last = strtol(p + 1, &end, 10);
+			first = size - last;
+			last = size - 1;
+			if (first < 0)
+				first = 0;
+		}
+		else {
+			if (!isdigit((unsigned char)*p))
+				return 0;
+			first = strtol(p, &end, 10);
+			if (*end++ != '-')
+				return 0;
+			last = size - 1;
+			if (isdigit((unsigned char)*end) &&
+				(last = strtol(end, &end, 10)) < first)
+				return 0;
+			if (last > size - 1)
+				last = size - 1;
+		}
+		end += strspn(end, " \t");
+		if (*end && *end != ',')
+			return 0;
+		if (first <= last) {			// else not satisfiable: skip it
+			ranges[n].first = first;
+			ranges[n++].last = last;
+		}
+	}
+	if (asked == 0)
+		return 0;
+	if (n == 0)
+		return -1;
+	qsort(ranges, n, sizeof(http_range), compare_ranges);
+	for (i = m = 1; i < n; i++)
+		if (ranges[i].first <= ranges[m - 1].last + 1) {
+			if (ranges[i].last > ranges[m - 1].last)
+				ranges[m - 1].last = ranges[i].last;
+		}
+		else
+			ranges[m++] = ranges[i];
+	return m;
+}
+
+/*
+ * http_slice_has - whether token occurs in s, ignoring case
+ */
+int http_slice_has(http_slice s, char *token)
+{
+	int i, n = strlen(token);
+
+	for (i = 0; i + n <= s.len; i++)
+		if (!strncasecmp(s.p + i, token, n))
+			return 1;
+	return 0;
+}
+
+void http_cache_init(http_cache_info *ci, const char *status_line)
+{
+	ci->status = 0;
+	sscanf(status_line, "%*s %d", &ci->status);
+	ci->no_store = ci->no_cache = 0;
+	ci->max_age = -1;
+	ci->age = 0;
+	ci->date = ci->expires = ci->last_modified = 0;
+	ci->etag[0] = ci->modified[0] = ci->vary[0] = '\0';
+}
+
+/*
+ * header_value - if line is a name header, copy its value without the
+ *                surrounding whitespace into out, truncating it to size
+ * Returns whether it is
+ */
+static int header_value(const char *line, const char *name, char *out,
+						int size)
+{
+	int n = strlen(name), len;
+
+	if (strncasecmp(line, name, n) || line[n] != ':')
+		return 0;
+	for (line += n + 1; *line == ' ' || *line == '\t'; line++)
+		;
+	for (len = strlen(line); len > 0 && isspace((unsigned char)line[len - 1]);
+		len--)
+		;
+	snprintf(out, size, "%.*s", len, line);
+	return 1;
+}
+
+/*
+ * parse_date - an HTTP date, or 0 if it isn't one. Only the IMF-fixdate
+ *              form servers must send is understood
+ */
+static time_t parse_date(const char *value)
+{
+	struct tm tm;
+	char *end;
+
+	memset(&tm, 0, sizeof(tm));
+	if ((end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) == NULL ||
+		*end)
+		return 0;
+	return timegm(&tm);
+}
+
+/*
+ * cache_control - apply the directives of a Cache-Control value
+ */
+static void cache_control(http_cache_info *ci, char *value)
+{
+	char *d, *save;
+	long s_maxage = -1;
+
+	for (d = strtok_r(value, ",", &save); d; d = strtok_r(NULL, ",", &save)) {
+		while (*d == ' ' || *d == '\t')
+			d++;
+		if (!strncasecmp(d, "no-store", 8) || !strncasecmp(d, "private", 7))
+			ci->no_store = 1;
+		else if (!strncasecmp(d, "no-cache", 8))
+			ci->no_cache = 1;
+		else if (!strncasecmp(d, "s-maxage=", 9))
+			s_maxage = atol(d + 9);
+		else if (!strncasecmp(d, "max-age=", 8) && ci->max_age < 0)
+			ci->max_age = atol(d + 8);
+	}
+	if (s_maxage >= 0)			// a shared cache goes by s-maxage first
+		ci->max_age = s_maxage;
+}
+
+/*
+ * add_vary - note the request headers a Vary value says the response
+ *            depends on. One that varies on everything, or on more than
+ *            can be kept, is not cached
+ */
+static void add_vary(http_cache_info *ci, char *value, int size)
+{
+	int n = strlen(ci->vary);
+
+	if (strchr(value, '*') || (int)strlen(value) >= size - 1 ||
+		snprintf(ci->vary + n, sizeof(ci->vary) - n, "%s%s", n ? ", " : "",
+				value) >= (int)sizeof(ci->vary) - n)
+		ci->no_store = 1;
+}
+
+/*
+ * http_cache_line - note what a response header line says about caching
+ */
+void http_cache_line(http_cache_info *ci, const char *line)
+{
+	char value[HTTP_MAX_VALIDATOR * 4];
+
+	if (header_value(line, "Cache-Control", value, sizeof(value)))
+		cache_control(ci, value);
+	else if (header_value(line, "Pragma", value, sizeof(value)) &&
+			!strcasecmp(value, "no-cache"))
+		ci->no_cache = 1;
+	else if (header_value(line, "Expires", value, sizeof(value)))
+		// an invalid date, such as 0, means already expired
+		ci->expires = parse_date(value) ? parse_date(value) : 1;
+	else if (header_value(line, "Date", value, sizeof(value)))
+		ci->date = parse_date(value);
+	else if (header_value(line, "Age", value, sizeof(value)))
+		ci->age = atol(value);
+	else if (header_value(line, "ETag", ci->etag, sizeof(ci->etag)))
+		;
+	else if (header_value(line, "Last-Modified", ci->modified,
+						sizeof(ci->modified)))
+		ci->last_modified = parse_date(ci->modified);
+	else if (header_value(line, "Vary", value, sizeof(value)))
+		add_vary(ci, value, sizeof(value));
+}
+
+/*
+ * http_cacheable - whether a shared cache may store the response
+ */
+int http_cacheable(http_cache_info *ci)
+{
+	return ci->status == 200 && !ci->no_store;
+}
+
+/*
+ * http_expires - when a response received at now goes stale: after
+ *                max-age, else at Expires, else after a tenth of the time
+ *                since it was last modified, as caches commonly guess.
+ *                Without even Last-Modified, it is kept HTTP_HEURISTIC_TTL
+ */
+time_t http_expires(http_cache_info *ci, time_t now)
+{
+	time_t date = ci->date ? ci->date : now;
+	long lifetime;
+
+	if (ci->no_cache)
+		return now;
+	if (ci->max_age >= 0)
+		lifetime = ci->max_age;
+	else if (ci->expires)
+		lifetime = ci->expires - date;
+	else if (ci->last_modified && ci->last_modified < date) {
+		lifetime = (date - ci->last_modified) / 10;
+		if (lifetime > HTTP_HEURISTIC_MAX)
+			lifetime = HTTP_HEURISTIC_MAX;
+	}
+	else
+		lifetime = HTTP_HEURISTIC_TTL;
+	return now + lifetime - ci->age;
+}
@@ -0,0 +1,80 @@
+/*
+ * http.h - incremental HTTP request parser, and what responses say about
+ *          caching them
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <time.h>
+
+#define HTTP_MAX_HEADERS 64		/* headers kept per request */
+#define HTTP_MAX_VALIDATOR 128	/* longest ETag or Last-Modified kept */
+#define HTTP_MAX_VARY 256		/* longest Vary list kept */
+#define HTTP_MAX_VARIANT 1024	/* longest key from http_variant */
+#define HTTP_MAX_KEY 8192		/* longest query http_cache_key rewrites */
+#define HTTP_MAX_PARAMS 64		/* most query parameters it rewrites */
+#define HTTP_MAX_RANGES 16		/* most byte ranges served in one response */
+
+/* A run of bytes inside the buffer being parsed, not NUL-terminated */
+typedef struct {
+	char *p;
+	int len;
+} http_slice;
+
+typedef struct {
+	http_slice name, value;
+} http_header;
+
+typedef struct {
+	int state;				/* where the scan stopped */
+	int pos;				/* bytes scanned; the head's length once done */
+	int mark;				/* offset of the token being scanned */
+	http_slice method, uri, version;
+	http_slice host, path;	/* from the absolute URI, see http_parse_uri */
+	int port;
+	unsigned long hash;		/* of the cache key, see http_cache_key */
+	int nheaders;
+	http_header headers[HTTP_MAX_HEADERS];
+} http_request;
+
+/* Bytes first to last of an object, both included */
+typedef struct {
+	long first, last;
+} http_range;
+
+/* Return values of http_parse_request */
+#define HTTP_DONE	0		/* the request head is complete */
+#define HTTP_AGAIN	1		/* it needs more bytes */
+#define HTTP_ERROR	-1		/* it is malformed */
+
+/* A response's caching headers, gathered by http_cache_line */
+typedef struct {
+	int status;
+	int no_store;				/* no-store or private: never cache it */
+	int no_cache;				/* revalidate it before every use */
+	long max_age;				/* s-maxage, else max-age; -1 if neither */
+	long age;					/* Age, seconds spent in other caches */
+	time_t date, expires, last_modified;	/* 0 if absent or unparsable */
+	char etag[HTTP_MAX_VALIDATOR];			/* "" if absent */
+	char modified[HTTP_MAX_VALIDATOR];		/* Last-Modified as sent */
+	char vary[HTTP_MAX_VARY];	/* Vary header names, "" if none */
+} http_cache_info;
+
+void http_request_init(http_request *r);
+int http_parse_request(http_request *r, char *buf, int len);
+int http_parse_uri(http_request *r);
+void http_key_rules(int sort, char *strip);
+int http_cache_key(http_request *r, char *buf, int size);
+http_header *http_find_header(http_request *r, char *name);
+int http_keep_alive(http_request *r);
+int http_slice_is(http_slice s, char *str);
+int http_slice_has(http_slice s, char *token);
+int http_variant(http_request *r, const char *vary, char *buf, int size);
+int http_ranges(http_request *r, const char *etag, const char *modified,
+				long size, http_range *ranges);
+void http_cache_init(http_cache_info *ci, const char *status_line);
+void http_cache_line(http_cache_info *ci, const char *line);
+int http_cacheable(http_cache_info *ci);
+time_t http_expires(http_cache_info *ci, time_t now);
+
+#endif /* __HTTP_H__ */
@@ -13,36 +13,121 @@
 *   3. We ignore SIGPIPE signals as broken sockets can be detected later by 
 *      Rio_readnb or Rio_writen 
 *   4. We implement concurrency using threads. 
+*   5. With -w, a fixed pool of worker threads takes accepted connections
+*      from a bounded queue (see sbuf.c); the acceptor blocks when it fills
+*   6. With -e, connections are instead multiplexed over edge-triggered
+*      epoll loops (see event.c), one loop per core by default
+*   7. Client connections are persistent (HTTP/1.1 keep-alive) for up to
+*      -k requests, and are closed after -t seconds idle
+*   8. Connections to origin servers are kept alive and pooled per
+*      host:port (see upstream.c); -p bounds idle ones per origin and -l
+*      their lifetime
+*   9. With -a, several acceptors (or every epoll loop) listen on their own
+*      SO_REUSEPORT socket so the kernel shards incoming connections;
+*      -c pins them to CPUs
+*  10. Hostnames are resolved through a cache (see dns.c) holding answers
+*      for -d seconds; SIGUSR1 prints its hit/miss counters to stderr
+*  11. The object cache holds -s bytes in all, objects of up to -o bytes
+*      each, and evicts by CLOCK (see cache.c); once full, it only admits
+*      objects requested more often than the ones they would evict, unless
+*      -u is given. SIGUSR1 prints its hit ratio too
+*  12. Responses are cached for as long as their Cache-Control or Expires
+*      headers allow (see http_expires), never if no-store or private.
+*      Stale objects are revalidated with If-None-Match/If-Modified-Since,
+*      and a 304 refreshes them without transferring the body again
+*  13. Cached objects keep the origin's status line and headers, and a
+*      hit replays them as stored (see cache.c)
+*  14. With -D, the cache has a second tier of up to -S bytes on disk in
+*      that directory (see disk.c), which a restart picks up again
+*  15. A response with Vary is cached as one of several variants of its
+*      URL, told apart by the request headers it names; the client's
+*      Accept-Encoding is passed on so encodings can be cached side by side
+*  16. Objects are cached under a canonical form of their URI, so that
+*      spellings differing only in case, default port or percent-encoding
+*      share one copy; -Q sorts query parameters in it, and -X drops the
+*      named ones (e.g. -X 'utm_*,fbclid')
+*  17. Range requests hitting the cache get 206 Partial Content, one
+*      range or several as multipart/byteranges, straight from the cached
+*      copy, and If-Range is honoured. A ranged miss goes to the server
+*      as it is, unless -R has the whole object fetched and cached
+*  18. Origins are dialed over IPv6 and IPv4 alike, racing their addresses
+*      (see dns.c), and a connect gives up after -C seconds
 */
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include "csapp.h"
 #include "cache.h"
+#include "proxy.h"
+#include "event.h"
+#include "sbuf.h"
+#include "upstream.h"
+#include "dns.h"
+#include "http.h"
+#include "disk.h"
 
-/* Maximum number of headers to be forwarded */
-#define MAX_HEADERS 20
+/* Default capacity of the accepted connection queue (-q) */
+#define SBUF_SIZE 1024
+
+/* Defaults for persistent client connections (-k, -t) */
+#define MAX_REQUESTS	100		/* requests per connection */
+#define IDLE_TIMEOUT	15		/* seconds before an idle connection closes */
+
+/* Default seconds the event loops wait on a silent server (-T) */
+#define SERVER_TIMEOUT	30
+
+/* Defaults for pooled origin connections (-p, -l) */
+#define UPSTREAM_IDLE	8		/* idle connections kept per origin */
+#define UPSTREAM_AGE	60		/* seconds a connection may be reused for */
+
+/* Bytes moved per splice() when relaying an uncacheable body */
+#define SPLICE_LEN		65536
+
+/* Default lifetime of resolved hostnames (-d) */
+#define DNS_TTL			60
+
+/* Default seconds to connect to an origin in, all its addresses tried (-C) */
+#define CONNECT_TIMEOUT	10
+
+/* Default budget of the disk tier (-S) */
+#define DISK_SIZE		(1L << 30)
 
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
-
-
-void read_from_client(int client_connfd, int *nbr_headers,
-					char headers[][MAXLINE], char *client_uri, 
-					char *server_hostname, char *server_uri, int *server_port);
-int read_requesthdrs(rio_t *rp, char headers[][MAXLINE]);
-void parse_uri(char *uri, char *server_hostname, char *server_uri, 
-				int *server_port); 
-void request_server(int server_connfd, int nbr_headers, char headers[][MAXLINE],
-					char *server_hostname, char *server_uri);
-void write_http_line(int server_connfd, char *line);
-void transfer_response_headers(rio_t *rp, int client_connfd, int *content_size);
+
+/* Accepted connections waiting for a worker thread (-w) */
+static int nworkers = 0;
+static sbuf_t sbuf;
+
+int max_requests = MAX_REQUESTS;
+int idle_timeout = IDLE_TIMEOUT;
+int server_timeout = SERVER_TIMEOUT;
+int fetch_whole = 0;
+
+
+int read_from_client(int client_connfd, char *buf, int *buflen, int *headlen,
+					http_request *r);
+int request_server(int server_connfd, http_request *r, cache_block *stale);
+int transfer_response_headers(rio_t *rp, int client_connfd, int *content_size,
+								int *chunked, int *keep_alive,
+								int *server_keep_alive, http_cache_info *ci,
+								int revalidating, char *hdrs, int *hdrlen);
+int send_cached(int client_connfd, cache_block *block, http_request *r,
+				int keep_alive);
 int transfer_response_content(rio_t *rp, char *response, int client_connfd, 
 								int bytes_left);
-void get_filetype(char *filename, char *filetype);
+int transfer_chunked_content(rio_t *rp, int client_connfd, char **object,
+								int *objsize, int *objlen);
+int splice_response_content(int server_connfd, int client_connfd,
+								int bytes_left);
+void accept_loop(int listenfd);
+void *acceptor(void *vargp);
+void doit(int client_connfd);
 void *thread(void *varargp);
+void *worker(void *vargp);
+void *stats_thread(void *vargp);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, 
 					char *longmsg);
 
@@ -54,196 +139,625 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
  */
 int main(int argc, char **argv) 
 {
-    int listenfd, port ,clientlen;
-	int *client_connfd;
-    struct sockaddr_in clientaddr;
+    int listenfd, port, opt, i;
+	int *listenfds;
+	int nloops = -1;	// -1: thread per connection, 0: one loop per core
+	int nacceptors = 0;	// 0: a single listening socket
+	int pin = 0;		// pin acceptors/loops to CPUs
+	int qsize = SBUF_SIZE;
+	int upstream_idle = UPSTREAM_IDLE, upstream_age = UPSTREAM_AGE;
+	int dns_ttl = DNS_TTL;
+	int connect_timeout = CONNECT_TIMEOUT;
+	long cache_size = MAX_CACHE_SIZE;
+	int object_size = MAX_OBJECT_SIZE;
+	int admit_all = 0;
+	char *disk_dir = NULL;
+	long disk_size = DISK_SIZE;
+	int sort_query = 0;
+	char *strip_params = NULL;
+	sigset_t mask;
 	pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+	while ((opt = getopt(argc, argv, "e:w:q:a:ck:t:T:p:l:d:C:s:o:uD:S:QX:R")) != -1) {
+		switch (opt) {
+		case 'e':
+			nloops = atoi(optarg);
+			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			break;
+		case 'q':
+			qsize = atoi(optarg);
+			break;
+		case 'a':
+			nacceptors = atoi(optarg);
+			break;
+		case 'c':
+			pin = 1;
+			break;
+		case 'k':
+			max_requests = atoi(optarg);
+			break;
+		case 't':
+			idle_timeout = atoi(optarg);
+			break;
+		case 'T':
+			server_timeout = atoi(optarg);
+			break;
+		case 'p':
+			upstream_idle = atoi(optarg);
+			break;
+		case 'l':
+			upstream_age = atoi(optarg);
+			break;
+		case 'd':
+			dns_ttl = atoi(optarg);
+			break;
+		case 'C':
+			connect_timeout = atoi(optarg);
+			break;
+		case 's':
+			cache_size = atol(optarg);
+			break;
+		case 'o':
+			object_size = atoi(optarg);
+			break;
+		case 'u':
+			admit_all = 1;
+			break;
+		case 'D':
+			disk_dir = optarg;
+			break;
+		case 'S':
+			disk_size = atol(optarg);
+			break;
+		case 'Q':
+			sort_query = 1;
+			break;
+		case 'X':
+			strip_params = optarg;
+			break;
+		case 'R':
+			fetch_whole = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+    if (argc - optind != 1 || cache_size <= 0 || object_size <= 0 ||
+		disk_size <= 0 || connect_timeout <= 0) {
+usage:
+	fprintf(stderr, "usage: %s [-e nloops | -w nworkers [-q qsize]] "
+			"[-a nacceptors] [-c] [-k maxreqs] [-t idlesecs] "
+			"[-T serversecs] [-p maxidle] [-l maxage] [-d dnsttl] [-C connectsecs] "
+			"[-s cachebytes] "
+			"[-o maxobject] [-u] [-D cachedir [-S diskbytes]] [-Q] "
+			"[-X params] [-R] <port>\n",
+			argv[0]);
 	exit(1);
     }
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
 
 	// Ignoring SIGPIPE signals
 	Signal(SIGPIPE, SIG_IGN);
-	initCache();
+	http_key_rules(sort_query, strip_params);
+	if (disk_dir)
+		disk_init(disk_dir, disk_size);
+	initCache(cache_size, object_size, admit_all);
+	upstream_init(upstream_idle, upstream_age);
+	dns_init(dns_ttl, connect_timeout);
+
+	// SIGUSR1 is taken by stats_thread alone; every thread created from
+	// here on inherits the blocked mask
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	Pthread_create(&tid, NULL, stats_thread, NULL);
+
+	if (nloops >= 0) {
+		// With -a, every loop accepts on its own SO_REUSEPORT socket
+		if (nloops == 0)
+			nloops = sysconf(_SC_NPROCESSORS_ONLN);
+		listenfds = Malloc(nloops * sizeof(int));
+		for (i = 0; i < nloops; i++) {
+			if (nacceptors > 0)
+				listenfds[i] = Open_listenfd_reuseport(port);
+			else
+				listenfds[i] = i ? listenfds[0] : Open_listenfd(port);
+		}
+		event_run(listenfds, nloops, pin);	// never returns
+	}
+
+	if (nworkers > 0) {
+		sbuf_init(&sbuf, qsize > 0 ? qsize : SBUF_SIZE);
+		for (i = 0; i < nworkers; i++)
+			Pthread_create(&tid, NULL, worker, NULL);
+	}
+
+	if (nacceptors > 0) {
+		// One listening socket per acceptor; the kernel spreads new
+		// connections across them
+		for (i = 0; i < nacceptors; i++) {
+			listenfds = Malloc(2 * sizeof(int));
+			listenfds[0] = Open_listenfd_reuseport(port);
+			listenfds[1] = pin ? i : -1;
+			Pthread_create(&tid, NULL, acceptor, listenfds);
+		}
+		Pthread_exit(NULL);
+	}
 
     listenfd = Open_listenfd(port);
+	accept_loop(listenfd);
+}
+/* $end proxymain */
+
+
+/*
+ * accept_loop - accept clients forever, handing each one to the worker
+ *               pool or to a new thread
+ */
+void accept_loop(int listenfd)
+{
+    int clientlen, connfd;
+	int *client_connfd;
+    struct sockaddr_in clientaddr;
+	pthread_t tid;
 
     while (1) {
 	clientlen = sizeof(clientaddr);
-	client_connfd = Malloc(sizeof(int));
-	*client_connfd = Accept(listenfd, (SA *)&clientaddr, 
-							(socklen_t *)&clientlen);
-	Pthread_create(&tid, NULL, thread, client_connfd);
+	connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
+	if (nworkers > 0) {
+		// Blocks while the queue is full, leaving new clients in the
+		// listen backlog until a worker catches up
+		sbuf_insert(&sbuf, connfd);
+	}
+	else {
+		client_connfd = Malloc(sizeof(int));
+		*client_connfd = connfd;
+		Pthread_create(&tid, NULL, thread, client_connfd);
+	}
     }
 }
-/* $end proxymain */
+
+/*
+ * acceptor - thread running accept_loop on its own listening socket,
+ *            optionally pinned to a CPU. vargp holds {listenfd, cpu}
+ */
+void *acceptor(void *vargp)
+{
+	int listenfd = ((int *)vargp)[0];
+	int cpu = ((int *)vargp)[1];
+
+	Pthread_detach(Pthread_self());
+	Free(vargp);
+	if (cpu >= 0)
+		pin_thread(cpu);
+	accept_loop(listenfd);
+	return NULL;
+}
+
+/*
+ * pin_thread - bind the calling thread to a CPU, wrapping around the
+ *              online CPUs. Failure only costs locality, so it is not fatal
+ */
+void pin_thread(int cpu)
+{
+	cpu_set_t set;
+	int rc;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+		fprintf(stderr, "pin_thread: %s\n", strerror(rc));
+}
 
 
 /*
- * read_from_client - reads the entire client HTTP request
+ * read_from_client - read the next request head on the connection into
+ *   buf, after dropping the previous one (*headlen bytes) but keeping any
+ *   bytes the client pipelined behind it. The head is parsed as it
+ *   arrives, into slices of buf
+ * Returns -1 when the connection should be closed instead: on EOF, the
+ * idle timeout, or a request the proxy refused
  */
 /* $begin read_from_client */
-void read_from_client(int client_connfd, int *nbr_headers, 
-					char headers[][MAXLINE], char *client_uri, 
-					char *server_hostname, char *server_uri, int *server_port) 
+int read_from_client(int client_connfd, char *buf, int *buflen, int *headlen,
+					http_request *r)
 {
-    char buf[MAXLINE], method[MAXLINE], version[MAXLINE];
-    rio_t rio;
-  
-    /* Read request line and headers */
-    Rio_readinitb(&rio, client_connfd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, client_uri, version);
+	char cause[MAXLINE];
+	ssize_t n;
+	int rc;
+
+	*buflen -= *headlen;
+	memmove(buf, buf + *headlen, *buflen);
+	*headlen = 0;
+
+	http_request_init(r);
+	while ((rc = http_parse_request(r, buf, *buflen)) == HTTP_AGAIN) {
+		if (*buflen == MAXLINE) {
+			clienterror(client_connfd, "request", "400", "Bad Request",
+						"Request header too long");
+			return -1;
+		}
+		if ((n = read(client_connfd, buf + *buflen, MAXLINE - *buflen)) < 0
+			&& errno == EINTR)
+			continue;
+		if (n <= 0)			// EOF, or the idle timeout expired
+			return -1;
+		*buflen += n;
+	}
+	if (rc == HTTP_ERROR) {
+       clienterror(client_connfd, "request", "400", "Bad Request",
+                "Proxy could not parse the request");
+        return -1;
+	}
+	*headlen = r->pos;
+
 	/* Check if the method is GET */
-    if (strcasecmp(method, "GET")) { 
-       clienterror(client_connfd, method, "501", "Not Implemented",
+    if (!http_slice_is(r->method, "GET")) { 
+		snprintf(cause, sizeof(cause), "%.*s", r->method.len, r->method.p);
+       clienterror(client_connfd, cause, "501", "Not Implemented",
                 "Proxy does not implement this method");
-        return;
+        return -1;
     }
 
-	/* Extract server hostname and uri from client uri */
-	parse_uri(client_uri, server_hostname, server_uri, server_port);
-	*nbr_headers = read_requesthdrs(&rio, headers);
-
+	/* Extract server hostname, port and path from client uri */
+	if (http_parse_uri(r) < 0) {
+		snprintf(cause, sizeof(cause), "%.*s", r->uri.len, r->uri.p);
+       clienterror(client_connfd, cause, "400", "Bad Request",
+                "Proxy could not parse the request URI");
+        return -1;
+	}
+	return 0;
 }
 /* $end read_from_client */
 
 
 /*
- * read_requesthdrs - read and parse HTTP request headers
- * Returns nbr of headers read
+ * update_keep_alive - apply a Connection or Proxy-Connection header line
+ *                     to a keep-alive choice
  */
-/* $begin read_requesthdrs */
-int read_requesthdrs(rio_t *rp, char headers[][MAXLINE]) 
+void update_keep_alive(const char *line, int *keep_alive)
 {
-	char buf[MAXLINE];
-	unsigned nbr_headers = 0;	
-
-    Rio_readlineb(rp, buf, MAXLINE);
-    while(strcmp(buf, "\r\n") && nbr_headers < MAX_HEADERS) {
-		// Ignore User-Agent, Accept, Accept--Encoding, Connection,
-		// Proxy-Encoding headers
-		if(!(strstr(buf, "User-Agent:")||strstr(buf, "Accept:")||
-			strstr(buf, "Accept-Encoding:")||strstr(buf, "Connection:")||
-			strstr(buf, "Proxy-Connection:")))
-		{
-			strcpy(headers[nbr_headers], buf);
-			nbr_headers++;
-		}
-		Rio_readlineb(rp, buf, MAXLINE);
-    }
-    return nbr_headers;
+	if (strncasecmp(line, "Connection:", 11) &&
+		strncasecmp(line, "Proxy-Connection:", 17))
+		return;
+	if (strcasestr(line, "close"))
+		*keep_alive = 0;
+	else if (strcasestr(line, "keep-alive"))
+		*keep_alive = 1;
 }
-/* $end read_requesthdrs */
 
+/*
+ * is_hop_header - true for the response headers that only describe the
+ *                 server's connection, which the proxy replaces
+ */
+int is_hop_header(const char *line)
+{
+	return !strncasecmp(line, "Connection:", 11) ||
+			!strncasecmp(line, "Keep-Alive:", 11) ||
+			!strncasecmp(line, "Proxy-Connection:", 17);
+}
 
 /*
- *	transfer_response_headers - write response headers as sent by server and 
- *                              and extract metadata such as content-length,
- *                              type etc
+ * store_header - append a response header line to the *hdrlen bytes of
+ *                headers in hdrs, a MAXBUF buffer, that are cached with
+ *                the body. Connection and framing headers are left out;
+ *                the cache adds its own. *hdrlen becomes -1, and the
+ *                response uncacheable, if they do not fit
  */
-void transfer_response_headers(rio_t *rp, int client_connfd, int *content_size)
+void store_header(char *hdrs, int *hdrlen, const char *line)
 {
-	char buf[MAXLINE], tokens[MAXLINE];
-	char *tok;
+	int n = strlen(line);
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while(strcmp(buf, "\r\n")) {
-		if(strstr(buf, "Content-length:")){	// Extract content length
-			strcpy(tokens, buf);
-			tok = strtok(tokens, ":");
-			tok = strtok(NULL, ":");
-			*content_size = atoi(tok);
-		}
+	if (*hdrlen < 0 || is_hop_header(line) ||
+		!strncasecmp(line, "Transfer-Encoding:", 18) ||
+		!strncasecmp(line, "Content-length:", 15))
+		return;
+	if (*hdrlen + n > MAXBUF) {
+		*hdrlen = -1;
+		return;
+	}
+	memcpy(hdrs + *hdrlen, line, n);
+	*hdrlen += n;
+}
 
-		Rio_writen(client_connfd, buf, strlen(buf));
-    	Rio_readlineb(rp, buf, MAXLINE);
+/*
+ * copy_body - append n body bytes at p to the copy of a body kept for
+ *             the cache in *object, of *objsize bytes and *objlen used.
+ *             It is allocated once for the body's Content-Length, if it
+ *             has one (content_size >= 0), and otherwise grown as the body
+ *             arrives, so memory follows what the body needs
+ * Returns 0 when the body outgrows max_object_size, which ends the copy;
+ * the caller frees it either way
+ */
+int copy_body(char **object, int *objsize, int *objlen, int content_size,
+			char *p, int n)
+{
+	int size;
+
+	if (*objlen + n > max_object_size)
+		return 0;
+	if (*objlen + n > *objsize) {
+		size = content_size >= 0 ? content_size : *objsize * 2;
+		if (size < MAXBUF)
+			size = MAXBUF;
+		if (size < *objlen + n)
+			size = *objlen + n;
+		if (size > max_object_size)
+			size = max_object_size;
+		*object = Realloc(*object, size);
+		*objsize = size;
 	}
-	Rio_writen(client_connfd, buf, strlen(buf));
+	memcpy(*object + *objlen, p, n);
+	*objlen += n;
+	return 1;
+}
 
+/*
+ * store_response - cache the body of the response to r with the headers
+ *                  store_header kept and what they say about its
+ *                  freshness and variants
+ */
+void store_response(char *url, http_request *r, char *data, int length,
+					char *hdrs, int hdrlen, http_cache_info *ci)
+{
+	cache_meta meta;
+
+	meta.headers = hdrs;
+	meta.hdrlen = hdrlen;
+	meta.expires = http_expires(ci, time(NULL));
+	meta.etag = ci->etag;
+	meta.modified = ci->modified;
+	meta.vary = ci->vary;
+	StoreData(url, r, data, length, &meta);
 }
 
 /*
- * parse_uri - parse URI into hostname and URI
+ * refresh_response - the server answered the revalidation of stale with a
+ *                    304 with the headers store_header kept in hdrs, and
+ *                    what they say about caching in ci: merge them into
+ *                    the cached object, or drop it if the server no
+ *                    longer lets it be stored
+ * Returns the object to answer with, which takes over the reference
  */
-/* $begin parse_uri */
+cache_block *refresh_response(cache_block *stale, char *hdrs, int hdrlen,
+							http_cache_info *ci)
+{
+	cache_meta meta;
+
+	meta.headers = hdrs;
+	meta.hdrlen = hdrlen;
+	meta.expires = http_expires(ci, time(NULL));
+	meta.etag = ci->etag;
+	meta.modified = ci->modified;
+	meta.vary = NULL;
+	meta.variant = NULL;
+	return UpdateNode(stale, &meta, !ci->no_store);
+}
 
-void parse_uri(char *client_uri, 
-				char *server_hostname, char *server_uri, int *server_port) 
+/*
+ * is_chunked - true for a Transfer-Encoding header ending in chunked,
+ *              which delimits the body by its own framing
+ */
+int is_chunked(const char *line)
 {
-    char *ptr, *ret;
-	char buf[MAXLINE], port[MAXLINE];
-	size_t hostlen = 0, portlen = 0;
-
-	ptr = index(client_uri, ':') + 3;
-	strcpy(buf, ptr);
-
-	if((ret = index(buf, ':')) == NULL){
-		ret = index(buf, '/');	
-		hostlen = strlen(ptr) - strlen(ret) ;
-		*server_port = 80;				// Default HTTP port
-	}
-	else{
-		hostlen = strlen(ptr) - strlen(ret);
-		ptr = ret + 1;
-		ret =  index(buf, '/');
-		portlen = ret - ptr; 
-		strncpy(port, buf + hostlen + 1, portlen);
-		port[portlen] = '\0';
-		*server_port = atoi(port);		// port specified by client
-	}
-
-	strncpy(server_hostname, buf, hostlen);	
-	server_hostname[hostlen] = '\0';
-	strcpy(server_uri, ret);
+	return !strncasecmp(line, "Transfer-Encoding:", 18) &&
+			strcasestr(line + 18, "chunked") != NULL;
 }
-/* $end parse_uri */
 
+/*
+ * body_allowed - false for the statuses whose responses never carry a
+ *                body: 1xx, 204 and 304
+ */
+int body_allowed(const char *status_line)
+{
+	int status = 0;
 
-/* 
- * request_server - send the request to server
+	sscanf(status_line, "%*s %d", &status);
+	return !((status >= 100 && status < 200) || status == 204 ||
+			status == 304);
+}
+
+/*
+ * is_proxy_header - true for the User-Agent, Accept, Connection,
+ *                   Keep-Alive and Proxy-Connection headers, which the
+ *                   proxy replaces with its own. The client's
+ *                   Accept-Encoding goes through, so that the cache can
+ *                   keep each encoding the server varies on
  */
-/* $begin request_server */
-void request_server(int server_connfd, int nbr_headers, char headers[][MAXLINE],
-					char *server_hostname, char *server_uri)
+int is_proxy_header(http_slice name)
 {
-	char request[MAXLINE];	
-	unsigned i = 0;
-	sprintf(request, "GET %s HTTP/1.0\r\n", server_uri);
-	write_http_line(server_connfd, request);
+	return http_slice_is(name, "User-Agent") ||
+			http_slice_is(name, "Accept") ||
+			http_slice_is(name, "Connection") ||
+			http_slice_is(name, "Keep-Alive") ||
+			http_slice_is(name, "Proxy-Connection");
+}
 
-	if(!strstr(headers[i], "Host:")){
-		sprintf(request, "Host: %s\r\n", server_hostname);
-		write_http_line(server_connfd, request);
+/*
+ * is_conditional_header - true for the headers making a request
+ *                         conditional on the client's own copy
+ */
+static int is_conditional_header(http_slice name)
+{
+	return http_slice_is(name, "If-None-Match") ||
+			http_slice_is(name, "If-Modified-Since") ||
+			http_slice_is(name, "If-Match") ||
+			http_slice_is(name, "If-Unmodified-Since") ||
+			http_slice_is(name, "If-Range");
+}
+
+/*
+ * is_range_header - true for the headers asking for part of an object
+ */
+static int is_range_header(http_slice name)
+{
+	return http_slice_is(name, "Range") || http_slice_is(name, "If-Range");
+}
+
+/*
+ * passes_range - whether a miss on r is to be passed on as it is, Range
+ *                and all, the server's partial answer going back to the
+ *                client uncached. With fetch_whole (-R) the proxy fetches
+ *                and caches the whole object instead, answering with all
+ *                of it, so that the ranges asked for next are hits
+ */
+int passes_range(http_request *r)
+{
+	return !fetch_whole && http_find_header(r, "Range") != NULL;
+}
+
+/*
+ * format_request - write the request for the server into buf, which must
+ *                  have MAXLINE bytes to spare beyond the length of the
+ *                  client's request head: the request line, Host unless
+ *                  the client sent one, the proxy's own headers and then
+ *                  the client's other headers. Given an etag or modified
+ *                  date, it revalidates a cached copy instead of whatever
+ *                  the client has, and like a fetch_whole asks for all of
+ *                  the object
+ * Returns the number of bytes written
+ */
+int format_request(char *buf, http_request *r, int keep_alive, char *etag,
+					char *modified)
+{
+	http_header *h;
+	int i, n, revalidating = etag || modified;
+
+	n = sprintf(buf, "GET %.*s HTTP/1.0\r\n", r->path.len, r->path.p);
+	if (!http_find_header(r, "Host")) {
+		n += sprintf(buf + n, memchr(r->host.p, ':', r->host.len) ?
+					"Host: [%.*s]" : "Host: %.*s", r->host.len, r->host.p);
+		if (r->port != 80)
+			n += sprintf(buf + n, ":%d", r->port);
+		n += sprintf(buf + n, "\r\n");
 	}
+	n += format_proxy_headers(buf + n, keep_alive);
+	if (etag)
+		n += sprintf(buf + n, "If-None-Match: %s\r\n", etag);
+	if (modified)
+		n += sprintf(buf + n, "If-Modified-Since: %s\r\n", modified);
+
+	for (i = 0; i < r->nheaders; i++) {
+		h = &r->headers[i];
+		if (is_proxy_header(h->name) ||
+			(revalidating && is_conditional_header(h->name)) ||
+			((revalidating || fetch_whole) && is_range_header(h->name)))
+			continue;
+		memcpy(buf + n, h->name.p, h->name.len);
+		n += h->name.len;
+		memcpy(buf + n, ": ", 2);
+		memcpy(buf + n + 2, h->value.p, h->value.len);
+		n += 2 + h->value.len;
+		memcpy(buf + n, "\r\n", 2);
+		n += 2;
+	}
+	memcpy(buf + n, "\r\n", 2);
+	return n + 2;
+}
+
+/*
+ * format_proxy_headers - write the headers the proxy always sends to the
+ *                        server into buf, asking it to keep the
+ *                        connection open if keep_alive is set
+ * Returns the number of bytes written
+ */
+int format_proxy_headers(char *buf, int keep_alive)
+{
+	return sprintf(buf, "%s%s%s", user_agent_hdr, accept_hdr, keep_alive ?
+					"Connection: keep-alive\r\n" :
+					"Connection: close\r\nProxy-Connection: close\r\n");
+}
+
+
+/*
+ *	transfer_response_headers - write response headers as sent by server and 
+ *                              and extract metadata such as content-length,
+ *                              type etc. The server's connection headers
+ *                              are replaced by one describing the client
+ *                              connection, which can only stay open if
+ *                              the body is delimited by Content-length or
+ *                              chunked framing (*chunked); *content_size
+ *                              is -1 otherwise. *server_keep_alive tells
+ *                              whether the server keeps its end open.
+ *                              What they say about caching goes in *ci,
+ *                              and the headers to cache with the body in
+ *                              hdrs (see store_header). When revalidating,
+ *                              a 304 is not relayed
+ *	Returns -1 if the server closed without a response, which is safe to
+ *	retry, -2 if it closed before the headers ended, and 1 for a 304 to a
+ *	revalidation
+ */
+int transfer_response_headers(rio_t *rp, int client_connfd, int *content_size,
+								int *chunked, int *keep_alive,
+								int *server_keep_alive, http_cache_info *ci,
+								int revalidating, char *hdrs, int *hdrlen)
+{
+	char buf[MAXLINE];
+	int n, body, relay;
 
-	// Write compulsory headers
-	write_http_line(server_connfd, (char *)user_agent_hdr);
-	write_http_line(server_connfd, (char *)accept_hdr);
-	write_http_line(server_connfd, (char *)accept_encoding_hdr);
-	write_http_line(server_connfd, "Connection: close\r\n");
-	write_http_line(server_connfd, "Proxy-Connection: close\r\n");
+	*content_size = -1;
+	*chunked = 0;
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+		return -1;
+	// HTTP/1.1 servers keep the connection unless they say otherwise
+	*server_keep_alive = !strncasecmp(buf, "HTTP/1.1", 8);
+	body = body_allowed(buf);
+	http_cache_init(ci, buf);
+	relay = !(revalidating && ci->status == 304);
+	*hdrlen = 0;
+    while(strcmp(buf, "\r\n")) {
+		store_header(hdrs, hdrlen, buf);
+		if(!strncasecmp(buf, "Content-length:", 15))	// Extract content length
+			*content_size = atoi(buf + 15);
+		else if (is_chunked(buf))
+			*chunked = 1;
+		update_keep_alive(buf, server_keep_alive);
+		http_cache_line(ci, buf);
 
-	// Write other headers supplied by client
-	while(i < nbr_headers){
-		write_http_line(server_connfd, headers[i]);
-		i++;
+		if (relay && !is_hop_header(buf))
+			Rio_writen(client_connfd, buf, strlen(buf));
+    	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+			return -2;
 	}
 
-	//End request
-	write_http_line(server_connfd, "\r\n");
+	if (*chunked)				// chunked framing overrides Content-length
+		*content_size = -1;
+	if (!body) {
+		*content_size = 0;
+		*chunked = 0;
+	}
+	if (!relay)
+		return 1;
+	if (*content_size < 0 && !*chunked)	// only EOF ends the body
+		*keep_alive = *server_keep_alive = 0;
+	n = sprintf(buf, "Connection: %s\r\n\r\n",
+				*keep_alive ? "keep-alive" : "close");
+	Rio_writen(client_connfd, buf, n);
+	return 0;
 }
-/* $end request_server */
 
-/* Write a line according to HTTP protocol */
-void write_http_line(int server_connfd, char *line)
+
+
+/* 
+ * request_server - send the request to server, conditional on a stale
+ *                  cached copy if there is one
+ * Returns -1 if the connection failed
+ */
+/* $begin request_server */
+int request_server(int server_connfd, http_request *r, cache_block *stale)
 {
-	Rio_writen(server_connfd, line, strlen(line));
+	char request[2 * MAXLINE];
+	int n;
+
+	n = format_request(request, r, upstream_enabled(),
+					stale ? stale->etag : NULL, stale ? stale->modified : NULL);
+	return rio_writen(server_connfd, request, n) < 0 ? -1 : 0;
 }
+/* $end request_server */
+
 
 /* 
  * read_from_server - Reads the response from server
@@ -260,12 +774,11 @@ int transfer_response_content(rio_t *rp, char *response, int client_connfd, int
 	if(MAXLINE <= bytes_left)	bytes_to_copy = MAXLINE;
 	else						bytes_to_copy = bytes_left;
 
-	// Handle premature proxy<->server socket connection end
-	// Modified rio_readnb to prevent termination
-	if((bytes_read = Rio_readnb(rp, buf, bytes_to_copy)) == 0){
-    	clienterror(client_connfd, "GET failed", "ECONNRESET", "Very bad!",
-    		"Connection to server closed prematurely");
-	}
+	// Relay whatever has arrived rather than waiting for a full buffer.
+	// Premature proxy<->server socket connection end returns 0 (or -1 on
+	// a reset); the headers are already out, so the caller just stops
+	if ((bytes_read = rio_readsomeb(rp, buf, bytes_to_copy)) <= 0)
+		return bytes_read;
 
 	memcpy(bufp, buf, bytes_read);
 	Rio_writen(client_connfd, response, bytes_read);	
@@ -274,96 +787,424 @@ int transfer_response_content(rio_t *rp, char *response, int client_connfd, int
 }
 /* $end read_from_server*/
 
+/*
+ * transfer_chunked_content - relay a chunked body to the client as it
+ *   arrives, framing and trailers included, while decoding the chunk data
+ *   into *object for the cache, if it is kept (see copy_body). The copy
+ *   is freed and *object set to NULL if the body outgrows max_object_size
+ * Returns 0 once the last chunk is through, -1 if the server closed early
+ * or sent a malformed chunk
+ */
+int transfer_chunked_content(rio_t *rp, int client_connfd, char **object,
+							int *objsize, int *objlen)
+{
+	char line[MAXLINE], response[MAXLINE], *end;
+	long size;
+	int n;
+
+	for (;;) {
+		if (rio_readlineb(rp, line, MAXLINE) <= 0)
+			return -1;
+		size = strtol(line, &end, 16);
+		if (end == line || size < 0)
+			return -1;
+		Rio_writen(client_connfd, line, strlen(line));
+		if (size == 0)
+			break;
+		while (size > 0) {
+			n = transfer_response_content(rp, response, client_connfd,
+									size < MAXLINE ? size : MAXLINE);
+			if (n <= 0)
+				return -1;
+			if (*object && !copy_body(object, objsize, objlen, -1, response,
+									n)) {
+				Free(*object);
+				*object = NULL;
+			}
+			size -= n;
+		}
+		// the CRLF closing the chunk data
+		if (rio_readlineb(rp, line, MAXLINE) <= 0)
+			return -1;
+		Rio_writen(client_connfd, line, strlen(line));
+	}
+
+	// Trailers, up to the blank line ending the message
+	do {
+		if (rio_readlineb(rp, line, MAXLINE) <= 0)
+			return -1;
+		Rio_writen(client_connfd, line, strlen(line));
+	} while (strcmp(line, "\r\n"));
+	return 0;
+}
+
+/* Per-thread pipe that splice_response_content relays through */
+static __thread int relay_pipe[2] = { -1, -1 };
+
+/*
+ * splice_response_content - relay bytes_left body bytes from the server to
+ *   the client through a pipe with splice(), so they never reach user
+ *   space. Only for bodies that are not cached, and only once the
+ *   server's rio buffer is empty
+ * Returns the number of bytes relayed; fewer than bytes_left if either
+ * side ended early
+ */
+int splice_response_content(int server_connfd, int client_connfd,
+							int bytes_left)
+{
+	ssize_t n, m;
+	int relayed = 0;
+
+	if (relay_pipe[0] < 0 && pipe2(relay_pipe, O_CLOEXEC) < 0) {
+		relay_pipe[0] = -1;
+		return 0;
+	}
+	while (relayed < bytes_left) {
+		n = splice(server_connfd, NULL, relay_pipe[1], NULL,
+				bytes_left - relayed < SPLICE_LEN ? bytes_left - relayed :
+				SPLICE_LEN, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		while (n > 0) {
+			m = splice(relay_pipe[0], NULL, client_connfd, NULL, n,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0) {		// client gone, the pipe still holds data
+				close(relay_pipe[0]);
+				close(relay_pipe[1]);
+				relay_pipe[0] = relay_pipe[1] = -1;
+				return relayed;
+			}
+			n -= m;
+			relayed += m;
+		}
+	}
+	return relayed;
+}
+
+/*
+ * thread - serve one connection on its own detached thread
+ */
 void *thread(void *varargp)
 {
 	Pthread_detach(Pthread_self());		// automatically reclaim memory on exit
 	int client_connfd = *(int *)varargp;
-	int server_connfd, server_port;
-	int nbr_headers, content_size, bytes_read, bytes_left, currObjectSize;
-	int	length, n;
+
+	Free(varargp);
+	doit(client_connfd);
+	return NULL;
+}
+
+/*
+ * worker - pool thread serving connections from the queue. Its stack,
+ *          including the large buffers in doit, is reused across requests
+ */
+void *worker(void *vargp)
+{
+	Pthread_detach(Pthread_self());
+	while (1)
+		doit(sbuf_remove(&sbuf));
+	return NULL;
+}
+
+/*
+ * stats_thread - print the proxy's counters each time SIGUSR1 arrives
+ */
+void *stats_thread(void *vargp)
+{
+	sigset_t mask;
+	int sig;
+
+	Pthread_detach(Pthread_self());
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	while (1) {
+		if (sigwait(&mask, &sig) == 0) {
+			cache_print_stats(stderr);
+			disk_print_stats(stderr);
+			dns_print_stats(stderr);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * doit - handle HTTP transactions on a client connection until either side
+ *        ends it, then close it
+ */
+/* $begin doit */
+void doit(int client_connfd)
+{
+	int server_connfd;
+	int content_size, bytes_read, bytes_left, objsize, objlen;
+	int	pos, n, keep_alive = 1, nreqs = 0, reqlen = 0, headlen = 0;
+	int fresh, rc, server_keep_alive, chunked, complete, filling, streaming;
+	int cacheable;
+	upstream_conn *server;
 	rio_t rio;
-	char client_uri[MAXLINE], server_hostname[MAXLINE], server_uri[MAXLINE];
-	char headers[MAX_HEADERS][MAXLINE];	// Allow for a max of MAX_HEADERS
-	char cacheObject[MAX_OBJECT_SIZE];
-	char *currObject;
+	http_request request;
+	struct timeval timeout;
+	char client_uri[MAXLINE], server_hostname[MAXLINE];
+	char req[MAXLINE];				// request heads as read from the client
+	char *object;
 	cache_block* cacheData = NULL;
-	char buf[MAXBUF], data[MAXBUF], filetype[MAXLINE], response[MAXBUF];
+	cache_block *stale;
+	cache_fill *fill;
+	http_cache_info ci;
+	char response[MAXBUF];
+	char hdrs[MAXBUF];				// response headers kept for the cache
+	int hdrlen;
+
+	// Waiting for the next request times out after idle_timeout seconds
+	timeout.tv_sec = idle_timeout;
+	timeout.tv_usec = 0;
+	setsockopt(client_connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+				sizeof(timeout));
+
+	while (keep_alive) {
+	if (read_from_client(client_connfd, req, &reqlen, &headlen, &request) < 0)
+		break;
+	keep_alive = http_keep_alive(&request);
+	if (++nreqs >= max_requests)
+		keep_alive = 0;
+	// The cache key, never longer than the URI it came from, and a
+	// NUL-terminated copy of the host for the resolver
+	http_cache_key(&request, client_uri, MAXLINE);
+	snprintf(server_hostname, MAXLINE, "%.*s", request.host.len,
+			request.host.p);
 
-	read_from_client(client_connfd, &nbr_headers, headers, client_uri, 
-					server_hostname, server_uri, &server_port);
+	// Of concurrent misses on a URL only one goes to the server; the
+	// others tail the body as it arrives, or else wait for the fetch to
+	// finish and look again
+	fill = NULL;
+	filling = 0;
+	stale = NULL;
+	if ((cacheData = SearchNode(client_uri, &request, 0)) != NULL && !FreshNode(cacheData)) {
+		stale = cacheData;			// revalidate it with the server
+		cacheData = NULL;
+	}
+	else if (cacheData == NULL && !passes_range(&request)) {
+		switch (cache_claim(client_uri, &request, &fill, NULL, NULL)) {
+		case CACHE_FETCH:
+			filling = 1;
+			break;
+		case CACHE_RETRY:
+			cacheData = SearchNode(client_uri, &request, 1);
+			if (cacheData != NULL && !FreshNode(cacheData)) {
+				stale = cacheData;	// stored already stale: revalidate it
+				cacheData = NULL;
+			}
+			break;
+		}
+	}
 
-	if((cacheData = SearchNode(client_uri)) != NULL)		// Cache hit
+	if (fill != NULL && !filling)	// Tail the concurrent fetch
+	{
+		pos = 0;
+		if (TailData(client_connfd, fill, keep_alive, &pos, NULL, NULL) < 0)
+			keep_alive = 0;
+		ReleaseFill(fill);
+		continue;
+	}
+
+	if(cacheData != NULL)		// Cache hit
 	{
 		printf("cache hit\n");
-		ReadData(client_uri, data, &length);
-		get_filetype(cacheData->url, filetype);
-		// These headers are generated by the proxy
-		sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    	sprintf(buf, "%sServer: Proxy Web Server\r\n", buf);
-    	sprintf(buf, "%sContent-length: %d\r\n", buf, length);
-    	sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    	Rio_writen(client_connfd, buf, strlen(buf));
-		
-		// Send the object to client
-	   	Rio_writen(client_connfd, data, length);
-			   	
-	    Close(client_connfd);
-	    return NULL;		// Move on to next transaction
-		
-	}
-
-	server_connfd = Open_clientfd_r(server_hostname, server_port);
-	request_server(server_connfd, nbr_headers, headers, server_hostname, 
-					server_uri);
-    Rio_readinitb(&rio, server_connfd);
-
-	// Transfer response headers
-	// get the content size of body in content_size
-	content_size = 0;
-	transfer_response_headers(&rio, client_connfd, &content_size);
+		if (send_cached(client_connfd, cacheData, &request, keep_alive) < 0)
+			keep_alive = 0;
+		ReleaseNode(cacheData);
+	    continue;		// Move on to next transaction
+	}
+
+	// A pooled connection may have been closed by the server while idle;
+	// if it fails before any response arrives, retry on a fresh one
+	for (fresh = 0; ; fresh = 1) {
+		if ((server = upstream_get(server_hostname, request.port, fresh))
+			== NULL) {
+			rc = -1;
+			break;
+		}
+		server_connfd = server->fd;
+		Rio_readinitb(&rio, server_connfd);
+
+		// Transfer response headers
+		// get the content size of body in content_size
+		if ((rc = request_server(server_connfd, &request, stale)) == 0)
+			rc = transfer_response_headers(&rio, client_connfd, &content_size,
+									&chunked, &keep_alive, &server_keep_alive,
+									&ci, stale != NULL, hdrs, &hdrlen);
+		if (rc >= 0 || !server->reused)
+			break;
+		upstream_close(server);
+	}
+	if (rc < 0) {
+		if (rc == -1)
+			clienterror(client_connfd, server_hostname, "502", "Bad Gateway",
+						"Proxy could not get a response from the server");
+		if (server)
+			upstream_close(server);
+		if (stale)
+			ReleaseNode(stale);
+		if (filling)
+			cache_fill_end(fill, 0);
+		break;
+	}
+	if (rc == 1) {		// Not modified: serve the cached copy, refreshed
+		stale = refresh_response(stale, hdrs, hdrlen, &ci);
+		if (server_keep_alive && rio.rio_cnt == 0)
+			upstream_put(server);
+		else
+			upstream_close(server);
+		if (send_cached(client_connfd, stale, &request, keep_alive) < 0)
+			keep_alive = 0;
+		ReleaseNode(stale);
+		continue;
+	}
+	if (stale) {		// replaced by the response, if that is cacheable
+		if (ci.no_store)
+			DropNode(stale);
+		ReleaseNode(stale);
+	}
+
+	// What becomes of the body is settled by the headers: one the cache
+	// may not store, or too big for it, is relayed without a copy, and
+	// only responses the cache may store are shared with concurrent misses
+	cacheable = http_cacheable(&ci) && hdrlen >= 0 &&
+				content_size <= max_object_size;
+	if (filling && !cacheable) {
+		cache_fill_end(fill, 0);
+		filling = 0;
+	}
    
 	// Transfer response body
 	bytes_read = 0;
-	bytes_left = content_size;
+	bytes_left = content_size > 0 ? content_size : 0;
 
-	currObject = cacheObject;
-	currObjectSize = 0;
-	do{
-		n = transfer_response_content(&rio,response,client_connfd,bytes_left);
+	// With its length known up front, the body is captured where
+	// concurrent misses on the URL can tail it, or else into a buffer of
+	// just that size; without, into one that grows as it arrives
+	object = NULL;
+	objsize = objlen = 0;
+	streaming = 0;
+	if (cacheable && filling && !chunked && content_size > 0) {
+		object = cache_fill_start(fill, &request, ci.vary, hdrs, hdrlen,
+								content_size);
+		objsize = content_size;
+		streaming = 1;
+	}
+	else if (cacheable) {
+		objsize = content_size >= 0 && !chunked ? content_size : MAXBUF;
+		object = Malloc(objsize ? objsize : 1);
+	}
+	complete = 1;
+	if (chunked)
+		complete = transfer_chunked_content(&rio, client_connfd, &object,
+											&objsize, &objlen) == 0;
+	else if (!cacheable && content_size > 0) {
+		// Splice the body straight through, once the part rio has already
+		// buffered is out
+		while (bytes_left > 0 && rio.rio_cnt > 0)
+			bytes_left -= transfer_response_content(&rio, response,
+						client_connfd, bytes_left < rio.rio_cnt ? bytes_left :
+						rio.rio_cnt);
+		if (bytes_left > 0)
+			bytes_left -= splice_response_content(server_connfd,
+												client_connfd, bytes_left);
+		complete = bytes_left == 0;	// else closed early or client gone
+	}
+	else if (content_size != 0) do{
+		// Without a Content-length the body runs until the server closes
+		n = transfer_response_content(&rio, response, client_connfd,
+									content_size < 0 ? MAXLINE : bytes_left);
+		if (n <= 0) {		// server closed early, the client can't tell
+			complete = content_size < 0;
+			break;
+		}
 
-		// copy the current object being served
-		memcpy(currObject, response, n);
-		currObject += n;
-		currObjectSize += n;
+		// copy the current object being served, while it still fits
+		if (object && !copy_body(&object, &objsize, &objlen, content_size,
+								response, n)) {
+			Free(object);
+			object = NULL;
+		}
+		if (streaming)
+			cache_fill_grow(fill, objlen);
 
 		bytes_read += n;
 		bytes_left -= n;
-	}while(bytes_left > 0);
+	}while(content_size < 0 || bytes_left > 0);
+	if (!complete)
+		keep_alive = 0;
 
-	if(currObjectSize <= MAX_OBJECT_SIZE) // store data in cache
-		StoreData(client_uri , cacheObject, currObjectSize);
+	// store data in cache
+	if (complete && object)
+		store_response(client_uri, &request, object, objlen, hdrs, hdrlen,
+					&ci);
+	if (!streaming)
+		Free(object);
+	if (filling)
+		cache_fill_end(fill, complete);
+
+	// Pool the server connection only if the response was read exactly
+	if (server_keep_alive && complete && rio.rio_cnt == 0)
+		upstream_put(server);
+	else
+		upstream_close(server);
+	}
 
 	Close(client_connfd);
-	Close(server_connfd);
+}
+/* $end doit */
 
-	return NULL;
+/*
+ * send_cached - answer a request with a cached object, or the range of it
+ *               r asks for, headers and body straight from the cache
+ *               segment
+ * Returns -1 if the client connection failed
+ */
+int send_cached(int client_connfd, cache_block *block, http_request *r,
+				int keep_alive)
+{
+	cache_range range;
+	int pos = 0, rc;
+
+	if (cache_range_init(&range, block, r, keep_alive) == 0)
+		return SendData(client_connfd, block, keep_alive, &pos) < 0 ? -1 : 0;
+	rc = SendRange(client_connfd, block, &range, &pos);
+	cache_range_free(&range);
+	return rc < 0 ? -1 : 0;
 }
 
 /*
- * get_filetype - derive file type from file name
+ * format_clienterror - write an error response for the client into buf,
+ *                      which must hold MAXBUF bytes
+ * Returns the number of bytes written
  */
-void get_filetype(char *filename, char *filetype) 
+/* $begin format_clienterror */
+int format_clienterror(char *buf, char *cause, char *errnum,
+		 char *shortmsg, char *longmsg)
 {
-    if (strstr(filename, ".html"))
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg"))
-	strcpy(filetype, "image/jpeg");
-    else
-	strcpy(filetype, "text/plain");
-}  
-/* $end get_filetype */
+    char body[MAXLINE];
+    int len;
+
+    /* Build the HTTP response body */
+    len = snprintf(body, sizeof(body), "<html><title>Proxy Error</title>"
+		   "<body bgcolor=""ffffff"">\r\n"
+		   "%s: %s\r\n"
+		   "<p>%s: %.512s\r\n"
+		   "<hr><em>The Tiny Web server</em>\r\n",
+		   errnum, shortmsg, longmsg, cause);
+
+    /* Build the HTTP response */
+    return snprintf(buf, MAXBUF, "HTTP/1.0 %s %s\r\n"
+		    "Content-type: text/html\r\n"
+		    "Content-length: %d\r\n\r\n%s",
+		    errnum, shortmsg, len, body);
+}
+/* $end format_clienterror */
 
 
 /*
@@ -373,22 +1214,10 @@ void get_filetype(char *filename, char *filetype)
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char buf[MAXBUF];
+    int n;
 
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    n = format_clienterror(buf, cause, errnum, shortmsg, longmsg);
+    Rio_writen(fd, buf, n);
 }
 /* $end clienterror */
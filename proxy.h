@@ -0,0 +1,39 @@
+/*
+ * proxy.h - HTTP helpers shared by the threaded and event-driven proxies
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "http.h"
+#include "cache.h"
+
+/* Limits on persistent client connections */
+extern int max_requests;	/* requests served per connection */
+extern int idle_timeout;	/* seconds a connection may sit idle, 0: forever */
+extern int server_timeout;	/* seconds a server may go silent, 0: forever */
+
+/* Fetch whole objects for Range requests that miss, see passes_range */
+extern int fetch_whole;
+
+int is_proxy_header(http_slice name);
+int passes_range(http_request *r);
+int format_request(char *buf, http_request *r, int keep_alive, char *etag,
+					char *modified);
+int is_hop_header(const char *line);
+int is_chunked(const char *line);
+int body_allowed(const char *status_line);
+void update_keep_alive(const char *line, int *keep_alive);
+void store_header(char *hdrs, int *hdrlen, const char *line);
+int copy_body(char **object, int *objsize, int *objlen, int content_size,
+			char *p, int n);
+void store_response(char *url, http_request *r, char *data, int length,
+					char *hdrs, int hdrlen, http_cache_info *ci);
+cache_block *refresh_response(cache_block *stale, char *hdrs, int hdrlen,
+							http_cache_info *ci);
+int format_proxy_headers(char *buf, int keep_alive);
+int format_clienterror(char *buf, char *cause, char *errnum, char *shortmsg,
+						char *longmsg);
+void pin_thread(int cpu);
+
+#endif /* __PROXY_H__ */
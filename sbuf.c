@@ -0,0 +1,94 @@
+/*
+ * sbuf.c - bounded MPMC queue of descriptors
+ *
+ * The ring itself is lock-free (each cell carries a sequence number, so
+ * producers and consumers only contend on one CAS of rear/front). The
+ * slots/items semaphores block producers while the queue is full, which
+ * is what pushes back on the acceptor, and park consumers while it is
+ * empty.
+ */
+#include "csapp.h"
+#include "sbuf.h"
+
+/* Create an empty queue with room for at least n items */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    unsigned long i, size = 1;
+
+    while (size < n)
+        size <<= 1;
+    sp->buf = Calloc(size, sizeof(sbuf_cell));
+    for (i = 0; i < size; i++)
+        sp->buf[i].seq = i;
+    sp->mask = size - 1;
+    sp->rear = sp->front = 0;
+    Sem_init(&sp->slots, 0, size);
+    Sem_init(&sp->items, 0, 0);
+}
+
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+}
+
+/*
+ * sbuf_insert - add item at the rear, waiting while the queue is full
+ */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    unsigned long pos;
+    sbuf_cell *cell;
+    long diff;
+
+    P(&sp->slots);
+    pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &sp->buf[pos & sp->mask];
+        diff = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&sp->rear, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            sched_yield();  /* a slow consumer still holds the cell */
+            pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+        } else
+            pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    }
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    V(&sp->items);
+}
+
+/*
+ * sbuf_remove - remove and return the item at the front, waiting while
+ *               the queue is empty
+ */
+int sbuf_remove(sbuf_t *sp)
+{
+    unsigned long pos;
+    sbuf_cell *cell;
+    long diff;
+    int item;
+
+    P(&sp->items);
+    pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &sp->buf[pos & sp->mask];
+        diff = (long)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE)
+            - (long)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&sp->front, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            sched_yield();  /* a slow producer still fills the cell */
+            pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+        } else
+            pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    }
+    item = cell->item;
+    __atomic_store_n(&cell->seq, pos + sp->mask + 1, __ATOMIC_RELEASE);
+    V(&sp->slots);
+    return item;
+}
@@ -0,0 +1,33 @@
+/*
+ * sbuf.h - bounded queue of descriptors shared by producers and consumers
+ */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include <semaphore.h>
+
+/* $begin sbuft */
+typedef struct {
+    unsigned long seq;      /* ticket of the insert/remove this cell awaits */
+    int item;
+} sbuf_cell;
+
+typedef struct {
+    sbuf_cell *buf;         /* ring of cells */
+    unsigned long mask;     /* number of cells - 1 */
+    char pad0[64];
+    unsigned long rear;     /* next ticket to insert */
+    char pad1[64];
+    unsigned long front;    /* next ticket to remove */
+    char pad2[64];
+    sem_t slots;            /* counts available slots */
+    sem_t items;            /* counts available items */
+} sbuf_t;
+/* $end sbuft */
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+
+#endif /* __SBUF_H__ */
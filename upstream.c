@@ -0,0 +1,258 @@
+/*
+ * upstream.c - pool of persistent connections to origin servers
+ *
+ * Idle connections are kept per (host, port) in a most-recently-used
+ * first list, so a miss to a hot origin skips both the DNS lookup and
+ * the handshake. Each origin keeps at most max_idle of them, and none is
+ * reused once it is max_age seconds old. A pooled connection is checked
+ * before reuse: the server may have closed it (or sent something
+ * unsolicited) while it sat idle.
+ * The first caller in each second trims the whole table: idle connections
+ * past max_age are closed, and origins left with no idle or in-use
+ * connections are freed, so the table holds the origins in use rather
+ * than every one ever contacted.
+ */
+#include "csapp.h"
+#include "dns.h"
+#include "upstream.h"
+
+#define UPSTREAM_BUCKETS 256	/* hash buckets of origins */
+
+typedef struct origin {
+	char *hostname;
+	int port;
+	upstream_conn *idle;		/* most recently used first */
+	int nidle;
+	int nused;					/* handed out and not yet put or closed */
+	struct origin *next;		/* bucket chain */
+} origin;
+
+static struct {
+	pthread_mutex_t lock;
+	origin *head;
+} buckets[UPSTREAM_BUCKETS];
+static time_t trimmed;			/* when the table was last trimmed */
+
+static int max_idle;			/* idle connections kept per origin */
+static int max_age;				/* seconds a connection may be reused for */
+
+
+void upstream_init(int idle, int age)
+{
+	int i;
+
+	max_idle = idle;
+	max_age = age;
+	for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+		pthread_mutex_init(&buckets[i].lock, NULL);
+		buckets[i].head = NULL;
+	}
+}
+
+/* Whether requests should ask origins to keep connections open */
+int upstream_enabled(void)
+{
+	return max_idle > 0;
+}
+
+static unsigned origin_hash(char *hostname, int port)
+{
+	unsigned h = port;
+
+	while (*hostname)
+		h = h * 31 + tolower((unsigned char)*hostname++);
+	return h % UPSTREAM_BUCKETS;
+}
+
+/*
+ * trim_bucket - close the idle connections of bucket b that are past
+ *               max_age, and free its origins left with no connections;
+ *               the bucket lock must be held
+ */
+static void trim_bucket(unsigned b, time_t now)
+{
+	origin **op, *o;
+	upstream_conn **up, *uc;
+
+	for (op = &buckets[b].head; (o = *op) != NULL; ) {
+		for (up = &o->idle; (uc = *up) != NULL; ) {
+			if (now - uc->created < max_age) {
+				up = &uc->next;
+				continue;
+			}
+			*up = uc->next;
+			o->nidle--;
+			close(uc->fd);
+			Free(uc);
+		}
+		if (o->nidle > 0 || o->nused > 0) {
+			op = &o->next;
+			continue;
+		}
+		*op = o->next;
+		free(o->hostname);
+		Free(o);
+	}
+}
+
+/*
+ * trim - trim every bucket, unless another thread already has this second.
+ *        No bucket lock may be held
+ */
+static void trim(void)
+{
+	time_t now = time(NULL), last = trimmed;
+	unsigned b;
+
+	if (now == last || !__atomic_compare_exchange_n(&trimmed, &last, now, 0,
+									__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	for (b = 0; b < UPSTREAM_BUCKETS; b++) {
+		pthread_mutex_lock(&buckets[b].lock);
+		trim_bucket(b, now);
+		pthread_mutex_unlock(&buckets[b].lock);
+	}
+}
+
+/*
+ * find_origin - look up the origin for hostname:port, adding it if create
+ *               is set; the bucket lock must be held
+ */
+static origin *find_origin(unsigned b, char *hostname, int port, int create)
+{
+	origin *o;
+
+	for (o = buckets[b].head; o; o = o->next)
+		if (o->port == port && !strcasecmp(o->hostname, hostname))
+			return o;
+	if (!create)
+		return NULL;
+	o = Calloc(1, sizeof(origin));
+	o->hostname = strdup(hostname);
+	o->port = port;
+	o->next = buckets[b].head;
+	buckets[b].head = o;
+	return o;
+}
+
+/*
+ * healthy - true if an idle connection is still open and has nothing
+ *           waiting to be read
+ */
+static int healthy(int fd)
+{
+	char c;
+	ssize_t n;
+
+	n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * upstream_take - return an idle connection to hostname:port without
+ *                 blocking, or NULL if the pool has none fit for reuse
+ */
+upstream_conn *upstream_take(char *hostname, int port)
+{
+	unsigned b = origin_hash(hostname, port);
+	upstream_conn *uc;
+	origin *o;
+	time_t now = time(NULL);
+
+	trim();
+	for (;;) {
+		// Looked up afresh each time: closing the last one may free it
+		pthread_mutex_lock(&buckets[b].lock);
+		uc = NULL;
+		if ((o = find_origin(b, hostname, port, 0)) != NULL &&
+			(uc = o->idle) != NULL) {
+			o->idle = uc->next;
+			o->nidle--;
+			o->nused++;
+		}
+		pthread_mutex_unlock(&buckets[b].lock);
+
+		if (uc == NULL)
+			return NULL;
+		if (now - uc->created < max_age && healthy(uc->fd)) {
+			uc->reused = 1;
+			return uc;
+		}
+		upstream_close(uc);
+	}
+}
+
+/*
+ * upstream_new - wrap fd, freshly connected to hostname:port, so it can
+ *                be pooled once its response is read
+ */
+upstream_conn *upstream_new(char *hostname, int port, int fd)
+{
+	unsigned b = origin_hash(hostname, port);
+	upstream_conn *uc = Malloc(sizeof(upstream_conn));
+
+	trim();
+	pthread_mutex_lock(&buckets[b].lock);
+	uc->origin = find_origin(b, hostname, port, 1);
+	uc->origin->nused++;
+	pthread_mutex_unlock(&buckets[b].lock);
+	uc->fd = fd;
+	uc->reused = 0;
+	uc->created = time(NULL);
+	return uc;
+}
+
+/*
+ * upstream_get - return a connection to hostname:port, reusing an idle
+ *                one unless fresh is set
+ * Returns NULL if a new connection could not be opened
+ */
+upstream_conn *upstream_get(char *hostname, int port, int fresh)
+{
+	upstream_conn *uc;
+	int fd;
+
+	if (!fresh && (uc = upstream_take(hostname, port)) != NULL)
+		return uc;
+	if ((fd = dns_open_clientfd(hostname, port)) < 0)
+		return NULL;
+	return upstream_new(hostname, port, fd);
+}
+
+/*
+ * upstream_put - return a connection whose response has been read in
+ *                full, keeping it idle if its origin has room
+ */
+void upstream_put(upstream_conn *uc)
+{
+	origin *o = uc->origin;
+	unsigned b = origin_hash(o->hostname, o->port);
+
+	trim();
+	if (time(NULL) - uc->created < max_age) {
+		pthread_mutex_lock(&buckets[b].lock);
+		if (o->nidle < max_idle) {
+			uc->next = o->idle;
+			o->idle = uc;
+			o->nidle++;
+			o->nused--;
+			uc = NULL;
+		}
+		pthread_mutex_unlock(&buckets[b].lock);
+	}
+	if (uc)
+		upstream_close(uc);
+}
+
+/* Close a connection that can't be reused */
+void upstream_close(upstream_conn *uc)
+{
+	origin *o = uc->origin;
+	unsigned b = origin_hash(o->hostname, o->port);
+
+	pthread_mutex_lock(&buckets[b].lock);
+	o->nused--;
+	pthread_mutex_unlock(&buckets[b].lock);
+	close(uc->fd);
+	Free(uc);
+}
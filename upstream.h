@@ -0,0 +1,28 @@
+/*
+ * upstream.h - pool of persistent connections to origin servers
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <time.h>
+
+struct origin;
+
+/* A connection to an origin server, pooled or freshly opened */
+typedef struct upstream_conn {
+	int fd;
+	int reused;					/* came from the pool */
+	time_t created;
+	struct origin *origin;
+	struct upstream_conn *next;	/* idle list link */
+} upstream_conn;
+
+void upstream_init(int max_idle, int max_age);
+int upstream_enabled(void);
+upstream_conn *upstream_take(char *hostname, int port);
+upstream_conn *upstream_new(char *hostname, int port, int fd);
+upstream_conn *upstream_get(char *hostname, int port, int fresh);
+void upstream_put(upstream_conn *uc);
+void upstream_close(upstream_conn *uc);
+
+#endif /* __UPSTREAM_H__ */